@@ -16,7 +16,8 @@
 #include "motor.h"
 
 void brake_init(void) {
-    // brake pin as external input pin interrupt
-    GPIO_Init(BRAKE__PORT, BRAKE__PIN, GPIO_MODE_IN_FL_NO_IT); // with external interrupt
+    // brake pin as external input pin interrupt (port C interrupt shared with Hall sensor C,
+    // sensitivity on both edges set in hall_sensor_init())
+    GPIO_Init(BRAKE__PORT, BRAKE__PIN, GPIO_MODE_IN_FL_IT); // with external interrupt
 }
 
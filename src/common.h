@@ -20,6 +20,9 @@
 #define WALK_ASSIST_MODE                          7
 #define PWM_CALIBRATION_ASSIST_MODE               8
 #define ERPS_CALIBRATION_ASSIST_MODE              9
+#define HALL_CALIBRATION_MODE                     10
+#define ROTOR_OFFSET_CALIBRATION_MODE             11
+#define FOC_CALIBRATION_MODE                      12
 
 // error codes
 // #define NO_ERROR                                  0
@@ -20,6 +20,8 @@
 #include "uart.h"
 #include "brake.h"
 #include "lights.h"
+#include "wheel_speed_sensor.h"
+#include "pas.h"
 #include "common.h"
 
 // from v.1.1.0
@@ -29,6 +31,7 @@
 #define ERROR_TORQUE_SENSOR                     (1 << 1)	// "Torque Fault"
 #define ERROR_CADENCE_SENSOR		    		(1 << 2)	// "Cadence fault"
 #define ERROR_MOTOR_BLOCKED     				(1 << 3)	// "Motor Blocked"
+#define ERROR_HARDWARE_OVERCURRENT              (1 << 4)    // "Overcurrent" (TIM1 break input)
 #define ERROR_BATTERY_OVERCURRENT               (1 << 5)    // "Battery Overcurrent"
 #define ERROR_FATAL                             (1 << 6)	// "Comms"
 #define ERROR_SPEED_SENSOR	                    (1 << 7)	// "Speed fault"
@@ -52,6 +55,7 @@
 #define COMM_FRAME_TYPE_CONFIGURATIONS                3
 #define COMM_FRAME_TYPE_FIRMWARE_VERSION              4
 #define COMM_FRAME_TYPE_HALL_CALBRATION               5
+#define COMM_FRAME_TYPE_DIAGNOSTIC                    6
 
 // variables for various system functions
 volatile uint8_t ui8_m_system_state = ERROR_NOT_INIT; // start with system error because configurations are empty at startup
@@ -101,13 +105,97 @@ static uint8_t ui8_adc_battery_current_max = ADC_10_BIT_BATTERY_CURRENT_MAX;
 static uint8_t ui8_adc_battery_current_target = 0;
 static uint8_t ui8_duty_cycle_target = 0;
 static uint8_t ui8_hall_ref_angles_config[6];
+static uint16_t ui16_motor_launch_duty_k = MOTOR_LAUNCH_DUTY_K_36V;
+
+// calibration modes
+#define CALIBRATION_STATE_IDLE                    0
+#define CALIBRATION_STATE_RUNNING                 1
+#define CALIBRATION_STATE_DONE                    2
+#define CALIBRATION_STATE_ERROR                   3
+static uint8_t ui8_calibration_state = CALIBRATION_STATE_IDLE;
+static uint8_t ui8_riding_mode_old = OFF_MODE;
+static uint8_t ui8_hall_calibration_point = 0;
+static uint8_t ui8_hall_calibration_counter = 0;
+static uint8_t ui8_hall_calibration_timeout = 0;
+static uint32_t ui32_hall_calibration_sum[6];
+static uint16_t ui16_hall_calibration_x[HALL_CALIBRATION_POINTS];
+static uint16_t ui16_hall_calibration_y[6][HALL_CALIBRATION_POINTS];
+static uint8_t ui8_hall_calibration_angles[6];
+static uint8_t ui8_hall_calibration_offsets[6];
+
+// angle sweep (rotor offset calibration)
+static uint8_t ui8_angle_sweep_step = 0;
+static uint8_t ui8_angle_sweep_counter = 0;
+static uint8_t ui8_angle_sweep_timeout = 0;
+static uint16_t ui16_angle_sweep_current_sum;
+static uint16_t ui16_angle_sweep_current[ANGLE_SWEEP_POINTS_MAX];
+static int16_t i16_angle_sweep_result_x16;
+static uint16_t ui16_angle_sweep_phase_current_sum;
+static uint16_t ui16_angle_sweep_phase_current[ANGLE_SWEEP_POINTS_MAX];
+static uint8_t ui8_angle_sweep_phase_current_result;
+static int8_t i8_rotor_offset_calibration_result = 0;
+
+// FOC angle multiplicator calibration
+static uint8_t ui8_foc_calibration_point = 0;
+static int16_t i16_foc_calibration_angle_x16[FOC_CALIBRATION_POINTS];
+static uint8_t ui8_foc_calibration_phase_current[FOC_CALIBRATION_POINTS];
+static uint8_t ui8_foc_angle_multiplicator_calibrated = 0;
+static uint8_t ui8_calibration_erps_target;
+
+// hall counter offsets online adaptation
+static uint8_t ui8_hall_counter_offsets_config[6] = {
+        HALL_COUNTER_OFFSET_UP,
+        HALL_COUNTER_OFFSET_DOWN,
+        HALL_COUNTER_OFFSET_UP,
+        HALL_COUNTER_OFFSET_DOWN,
+        HALL_COUNTER_OFFSET_UP,
+        HALL_COUNTER_OFFSET_DOWN};
+static int32_t i32_hall_adapt_x_x256[2];
+static int32_t i32_hall_adapt_y_x256[2][6];
+static uint16_t ui16_hall_adapt_samples[2];
+static uint16_t ui16_hall_adapt_update_counter = 0;
+static uint16_t ui16_hall_adapt_erps_old = 0;
+static uint8_t ui8_hall_adapt_estimate_valid = 0;
+
+// motor parameters online estimation
+static int32_t i32_motor_estimate_erps_x256[2];
+static int32_t i32_motor_estimate_current_x256[2];
+static int32_t i32_motor_estimate_voltage_x256[2];
+static uint16_t ui16_motor_estimate_samples[2];
+static uint16_t ui16_motor_estimate_update_counter = 0;
+static uint16_t ui16_motor_estimate_erps_old = 0;
+static uint8_t ui8_motor_estimate_duty_cycle_old = 0;
+static uint8_t ui8_motor_estimate_valid = 0;
+static uint16_t ui16_motor_k_estimate;
+static uint8_t ui8_motor_r_estimate;
+static uint16_t ui16_motor_r_winding_x16;
+static uint16_t ui16_motor_r_winding_reference_x16;
 
 // acceleration after braking smoothing
 static uint8_t ui8_brake_previously_set = 0;
 
 // cadence sensor
-uint16_t ui16_cadence_ticks_count_min_speed_adj = CADENCE_SENSOR_CALC_COUNTER_MIN;
+#define NO_PAS_REF 5
+static uint16_t ui16_cadence_ticks_count_min_speed_adj = CADENCE_SENSOR_CALC_COUNTER_MIN;
 static uint8_t ui8_pedal_cadence_RPM = 0;
+static uint16_t ui16_cadence_sensor_ticks = 0;
+static uint32_t ui32_crank_revolutions_x20 = 0;
+static uint16_t ui16_cadence_sensor_ticks_counter_min = CADENCE_SENSOR_CALC_COUNTER_MIN;
+static uint8_t ui8_pas_state_old = 4;
+static uint8_t ui8_cadence_calc_ref_state = NO_PAS_REF;
+const static uint8_t ui8_pas_old_valid_state[4] = { 0x01, 0x03, 0x00, 0x02 };
+// PAS FIFOs read indexes and TIM3 (4us) time base extended to 32 bits
+static uint8_t ui8_pas1_fifo_read_index = 0;
+static uint8_t ui8_pas2_fifo_read_index = 0;
+static uint16_t ui16_pas_timer_now;
+static uint16_t ui16_pas_timer_old;
+static uint32_t ui32_pas_timer = 0;
+static uint32_t ui32_pas_transition_time = 0;
+// time of the last transition to each PAS state, forward transitions in the window (max 4)
+static uint32_t ui32_pas_edge_time[4];
+static uint8_t ui8_pas_transitions = 0;
+// part of the PAS period (x256) of the quarter ending with each PAS state (phase error correction)
+static uint8_t ui8_pas_quarter_x256[4] = { 64, 64, 64, 64 };
 volatile uint8_t ui8_brake_fast_stop = 0;
 
 // torque sensor
@@ -133,7 +221,7 @@ static uint8_t ui16_adc_torque_filtered = 0;
 
 // wheel speed sensor
 static uint16_t ui16_wheel_speed_x10 = 0;
-static uint16_t ui16_wheel_calc_const;
+static uint32_t ui32_wheel_calc_const;
 
 // throttle control
 volatile uint8_t ui8_throttle_adc = 0;
@@ -141,6 +229,7 @@ volatile uint8_t ui8_throttle_virtual;
 
 // motor temperature control
 static uint16_t ui16_adc_motor_temperature_filtered = 0;
+static uint8_t ui8_motor_winding_temperature_rise = 0; // from the estimated resistance, degC
 static uint16_t ui8_motor_temperature_filtered = 0;
 static uint8_t ui8_motor_temperature_max_value_to_limit = 0;
 static uint8_t ui8_motor_temperature_min_value_to_limit = 0;
@@ -407,9 +496,21 @@ static void get_battery_voltage(void);
 static void get_pedal_torque(void);
 static void calc_wheel_speed(void);
 static void calc_cadence(void);
+static void cadence_pas_transition(uint8_t ui8_state, uint32_t ui32_time);
+static void pas_timer_update(void);
+static void new_torque_sample(void);
+static void torque_samples_reset(void);
 
 static void ebike_control_lights(void);
 static void ebike_control_motor(void);
+static uint8_t controller_target_slew_inverse_step(uint8_t ui8_target_old, uint8_t ui8_target_new);
+#ifdef PWM_FREQUENCY_SELECT
+static void pwm_frequency_select(void);
+static uint8_t pwm_ramp_scale(uint8_t ui8_inverse_step);
+#define PWM_RAMP_SCALE(x)   pwm_ramp_scale(x)
+#else
+#define PWM_RAMP_SCALE(x)   (x)
+#endif
 static void check_system(void);
 
 static void apply_power_assist();
@@ -422,7 +523,20 @@ static void apply_walk_assist();
 static void apply_throttle();
 static void apply_pwm_calibration_assist();
 static void apply_erps_calibration_assist();
+static void apply_hall_calibration();
+static void hall_calib_cnt_read(uint16_t *p_ui16_hall_cnt);
+static void apply_rotor_offset_calibration();
+static void apply_foc_calibration();
+static uint8_t angle_sweep(uint8_t ui8_erps_target, int8_t i8_start, int8_t i8_step, uint8_t ui8_points);
+static void hall_counter_offsets_adapt(void);
+static void hall_counter_offsets_adapt_reset(void);
+static void motor_parameters_estimate(void);
+static void motor_parameters_estimate_reset(void);
+static uint8_t hall_calibration_solve(uint8_t ui8_points, uint16_t *ui16_x, uint16_t ui16_y[][HALL_CALIBRATION_POINTS]);
 static void apply_temperature_limiting();
+#ifdef MOTOR_WINDING_TEMPERATURE_LIMIT
+static void apply_winding_temperature_limiting(void);
+#endif
 static void apply_speed_limit();
 static void set_motor_acceleration();
 
@@ -446,6 +560,17 @@ void ebike_app_controller(void) {
     // check if there are any errors for motor control
     check_system();
 
+    // adapt Hall counter offsets at steady speed
+    hall_counter_offsets_adapt();
+
+    // estimate motor back EMF constant and resistance at steady speed
+    motor_parameters_estimate();
+
+    #ifdef PWM_FREQUENCY_SELECT
+    // select the PWM frequency for the current speed and load
+    pwm_frequency_select();
+    #endif
+
     // use previously received data and sensor input to control motor
     ebike_control_motor();
     
@@ -467,7 +592,71 @@ void ebike_app_controller(void) {
      ------------------------------------------------------------------------*/
 }
 
+#ifdef PWM_FREQUENCY_SELECT
+// Ramp inverse steps are in PWM_CYCLES_SECOND cycles: convert to cycles of the current PWM frequency
+static uint8_t pwm_ramp_scale(uint8_t ui8_inverse_step) {
+    uint16_t ui16_inverse_step = ((uint16_t) ui8_inverse_step * ui8_pwm_ramp_scale_x128) >> 7;
+
+    if (ui16_inverse_step > 255)
+        return 255;
+    return (uint8_t) ui16_inverse_step;
+}
+
+// Higher frequency at low speed (smoother current), lower frequency at high load (lower switching losses)
+static void pwm_frequency_select(void) {
+    static uint8_t ui8_hold_off_counter;
+    uint8_t ui8_frequency = ui8_pwm_frequency_request;
+
+    if (ui8_hold_off_counter) {
+        ui8_hold_off_counter--;
+        return;
+    }
+
+    if ((ui8_adc_battery_current_filtered > PWM_FREQUENCY_HIGH_LOAD_ADC_CURRENT)
+            && (ui8_g_duty_cycle < PWM_FREQUENCY_LOW_DUTY_CYCLE_MAX)) {
+        ui8_frequency = PWM_FREQUENCY_LOW;
+    } else if ((ui8_frequency != PWM_FREQUENCY_LOW)
+            || (ui8_adc_battery_current_filtered < (PWM_FREQUENCY_HIGH_LOAD_ADC_CURRENT - PWM_FREQUENCY_CURRENT_HYSTERESIS))
+            || (ui8_g_duty_cycle >= PWM_FREQUENCY_LOW_DUTY_CYCLE_MAX)) {
+        if (ui16_motor_speed_erps < PWM_FREQUENCY_LOW_SPEED_ERPS) {
+            ui8_frequency = PWM_FREQUENCY_HIGH;
+        } else if ((ui8_frequency != PWM_FREQUENCY_HIGH)
+                || (ui16_motor_speed_erps > (PWM_FREQUENCY_LOW_SPEED_ERPS + PWM_FREQUENCY_ERPS_HYSTERESIS))) {
+            ui8_frequency = PWM_FREQUENCY_DEFAULT;
+        }
+    }
+
+    if (ui8_frequency != ui8_pwm_frequency_request) {
+        ui8_pwm_frequency_request = ui8_frequency;
+        ui8_hold_off_counter = PWM_FREQUENCY_HOLD_OFF;
+    }
+}
+#endif
+
+// PWM cycles per unit step to slew a controller target from the old to the new value in one loop period
+static uint8_t controller_target_slew_inverse_step(uint8_t ui8_target_old, uint8_t ui8_target_new) {
+    uint8_t ui8_delta;
+    uint16_t ui16_inverse_step;
+
+    if (ui8_target_new > ui8_target_old)
+        ui8_delta = ui8_target_new - ui8_target_old;
+    else
+        ui8_delta = ui8_target_old - ui8_target_new;
+
+    if (ui8_delta == 0)
+        return 255;
+
+    ui16_inverse_step = CONTROLLER_TARGET_SLEW_PWM_CYCLES / ui8_delta;
+    if (ui16_inverse_step > 255)
+        return 255;
+    if (ui16_inverse_step > 0)
+        ui16_inverse_step--; // the ISR steps every (inverse step + 1) PWM cycles
+    return (uint8_t) ui16_inverse_step;
+}
+
 static void ebike_control_motor(void) {
+    uint8_t ui8_i;
+
     // reset control variables (safety)
     ui8_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT;
     ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT;
@@ -486,6 +675,22 @@ static void ebike_control_motor(void) {
         ui8_cruise_PID_initialize = 1;
     }
 
+    // angle sweep calibration left by the display: restore the Hall reference angles (a new sweep sets its own),
+    // the running state belongs to the new calibration when the display started one
+    if ((ui8_riding_mode != ui8_riding_mode_old)
+            && ((ui8_riding_mode_old == ROTOR_OFFSET_CALIBRATION_MODE) || (ui8_riding_mode_old == FOC_CALIBRATION_MODE))) {
+        for (ui8_i = 0; ui8_i < 6; ui8_i++) {
+            ui8_hall_ref_angles[ui8_i] = ui8_hall_ref_angles_config[ui8_i];
+        }
+        if ((ui8_calibration_state == CALIBRATION_STATE_RUNNING)
+                && (ui8_riding_mode != HALL_CALIBRATION_MODE)
+                && (ui8_riding_mode != ROTOR_OFFSET_CALIBRATION_MODE)
+                && (ui8_riding_mode != FOC_CALIBRATION_MODE)) {
+            ui8_calibration_state = CALIBRATION_STATE_IDLE;
+        }
+    }
+    ui8_riding_mode_old = ui8_riding_mode;
+
     // select riding mode
     switch (ui8_riding_mode) {
         case POWER_ASSIST_MODE: apply_power_assist(); break;
@@ -497,11 +702,17 @@ static void ebike_control_motor(void) {
 		case WALK_ASSIST_MODE: apply_walk_assist(); break;
         case PWM_CALIBRATION_ASSIST_MODE: apply_pwm_calibration_assist(); break;
         case ERPS_CALIBRATION_ASSIST_MODE: apply_erps_calibration_assist(); break;
+        case HALL_CALIBRATION_MODE: apply_hall_calibration(); break;
+        case ROTOR_OFFSET_CALIBRATION_MODE: apply_rotor_offset_calibration(); break;
+        case FOC_CALIBRATION_MODE: apply_foc_calibration(); break;
     }
 
     // select optional ADC function
     switch (m_configuration_variables.ui8_optional_ADC_function) {
         case THROTTLE_CONTROL:
+#ifdef MOTOR_WINDING_TEMPERATURE_LIMIT
+			apply_winding_temperature_limiting();
+#endif
 			apply_throttle();
 			break;
 		case TEMPERATURE_CONTROL:
@@ -509,6 +720,9 @@ static void ebike_control_motor(void) {
 			if (ui8_throttle_virtual) {apply_throttle();}
 			break;
 		default:
+#ifdef MOTOR_WINDING_TEMPERATURE_LIMIT
+			apply_winding_temperature_limiting();
+#endif
 			if (ui8_throttle_virtual) {apply_throttle();}
 			break;
     }
@@ -517,10 +731,13 @@ static void ebike_control_motor(void) {
     apply_speed_limit();
 
     // reset control parameters if... (safety)
-    if (ui8_brake_state || ui8_m_system_state & 8 || ui8_m_system_state & 32 || !ui8_motor_enabled) {
+    if (ui8_brake_state || ui8_m_system_state & 8 || ui8_m_system_state & 16 || ui8_m_system_state & 32 || !ui8_motor_enabled) {
         ui8_controller_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT;
         ui8_controller_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN;
+        // zero targets applied at once, without slew (set values first: the ISR can only decrement)
+        ui8_controller_adc_battery_current_target_set = 0;
         ui8_controller_adc_battery_current_target = 0;
+        ui8_controller_duty_cycle_target_set = 0;
         ui8_controller_duty_cycle_target = 0;
     } else {
         // limit max current if higher than configured hardware limit (safety)
@@ -549,16 +766,20 @@ static void ebike_control_motor(void) {
         }
 
         // set duty cycle ramp up in controller
-        ui8_controller_duty_cycle_ramp_up_inverse_step = ui8_duty_cycle_ramp_up_inverse_step;
+        ui8_controller_duty_cycle_ramp_up_inverse_step = PWM_RAMP_SCALE(ui8_duty_cycle_ramp_up_inverse_step);
 
         // set duty cycle ramp down in controller
-        ui8_controller_duty_cycle_ramp_down_inverse_step = ui8_duty_cycle_ramp_down_inverse_step;
+        ui8_controller_duty_cycle_ramp_down_inverse_step = PWM_RAMP_SCALE(ui8_duty_cycle_ramp_down_inverse_step);
 
-        // set target battery current in controller
-        ui8_controller_adc_battery_current_target = ui8_adc_battery_current_target;
+        // set target battery current in controller, slewed from the previous target in one loop period
+        ui8_controller_adc_battery_current_slew_inverse_step = PWM_RAMP_SCALE(
+                controller_target_slew_inverse_step(ui8_controller_adc_battery_current_target_set, ui8_adc_battery_current_target));
+        ui8_controller_adc_battery_current_target_set = ui8_adc_battery_current_target;
 
-        // set target duty cycle in controller
-        ui8_controller_duty_cycle_target = ui8_duty_cycle_target;
+        // set target duty cycle in controller, slewed from the previous target in one loop period
+        ui8_controller_duty_cycle_slew_inverse_step = PWM_RAMP_SCALE(
+                controller_target_slew_inverse_step(ui8_controller_duty_cycle_target_set, ui8_duty_cycle_target));
+        ui8_controller_duty_cycle_target_set = ui8_duty_cycle_target;
     }
 
     switch (ui8_m_motor_init_state)
@@ -581,6 +802,11 @@ static void ebike_control_motor(void) {
 	break;
 	}
 
+    // PWM outputs already disabled by the brake interrupt (fast stop)
+    if (ui8_motor_enabled && !ui8_g_motor_pwm_enabled) {
+        ui8_motor_enabled = 0;
+    }
+
     // check if the motor should be enabled or disabled
     if (ui8_motor_enabled
             && (ui16_motor_speed_erps == 0)
@@ -589,15 +815,49 @@ static void ebike_control_motor(void) {
         ui8_motor_enabled = 0;
         motor_disable_pwm();
     } else if (!ui8_motor_enabled
-            && (ui16_motor_speed_erps < 30) // enable the motor only if it rotates slowly or is stopped
+            && (ui16_motor_speed_erps < MOTOR_LAUNCH_ERPS_MAX) // initial duty cycle matches the motor back EMF
             && (ui8_adc_battery_current_target)
-            && (!ui8_brake_state)) {
-        ui8_motor_enabled = 1;
+            && (!ui8_brake_state)
+            && (!(ui8_m_system_state & ERROR_HARDWARE_OVERCURRENT))) {
         ui8_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT;
         ui8_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_MIN;
-        ui8_g_duty_cycle = PWM_DUTY_CYCLE_STARTUP;
-        ui8_fw_hall_counter_offset = 0;
-        motor_enable_pwm();
+        if (ui16_motor_speed_erps == 0) {
+            // rotor stopped: restart from the current Hall sector
+            motor_hall_align();
+        }
+        // initial duty cycle from motor speed and battery voltage
+        uint16_t ui16_launch_duty_cycle = PWM_DUTY_CYCLE_STARTUP;
+        if (ui16_adc_battery_voltage_filtered) {
+            // 32 bit product: the estimated K can be up to MOTOR_ESTIMATE_K_RANGE_PERCENT over the launch K
+            ui16_launch_duty_cycle += (uint16_t)(((uint32_t)ui16_motor_speed_erps
+                    * (ui8_motor_estimate_valid ? ui16_motor_k_estimate : ui16_motor_launch_duty_k))
+                    / ui16_adc_battery_voltage_filtered);
+        }
+        if (ui16_launch_duty_cycle >= PWM_DUTY_CYCLE_MAX) {
+            ui16_launch_duty_cycle = PWM_DUTY_CYCLE_MAX - 1;
+        }
+        // controller targets were zeroed above (motor disabled): seed them with the launch values,
+        // the next loop slews them from here instead of ramping the duty cycle down from the launch value
+        uint8_t ui8_launch_current_target = ui8_adc_battery_current_target;
+        if (ui8_launch_current_target > ui8_adc_battery_current_max) {
+            ui8_launch_current_target = ui8_adc_battery_current_max;
+        }
+        if (ui8_launch_current_target > ADC_10_BIT_BATTERY_CURRENT_MAX) {
+            ui8_launch_current_target = ADC_10_BIT_BATTERY_CURRENT_MAX;
+        }
+        // the brake pin interrupt (fast stop) must not be undone: brake checked again with interrupts disabled
+        disableInterrupts();
+        if (!ui8_brake_state) {
+            ui8_motor_enabled = 1;
+            ui8_controller_adc_battery_current_target_set = ui8_launch_current_target;
+            ui8_controller_adc_battery_current_target = ui8_launch_current_target;
+            ui8_controller_duty_cycle_target_set = (uint8_t)ui16_launch_duty_cycle;
+            ui8_controller_duty_cycle_target = (uint8_t)ui16_launch_duty_cycle;
+            ui8_g_duty_cycle = (uint8_t)ui16_launch_duty_cycle;
+            ui8_fw_hall_counter_offset = 0;
+            motor_enable_pwm();
+        }
+        enableInterrupts();
     }
 }
 
@@ -1171,6 +1431,703 @@ static void apply_erps_calibration_assist() {
     ui8_duty_cycle_target = ui8_calibration_assist_duty_cycle_target;
 }
 
+// Hall sector counts written by the PWM interrupt: copied with interrupts disabled (16 bit values)
+static void hall_calib_cnt_read(uint16_t *p_ui16_hall_cnt) {
+    uint8_t ui8_i_hall;
+
+    disableInterrupts();
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        p_ui16_hall_cnt[ui8_i_hall] = ui16_hall_calib_cnt[ui8_i_hall];
+    }
+    enableInterrupts();
+}
+
+static void apply_hall_calibration() {
+
+    uint8_t ui8_i_hall;
+    uint8_t ui8_erps_target;
+    uint16_t ui16_erps_error;
+    uint16_t ui16_total;
+    uint16_t ui16_hall_cnt[6];
+
+    // motor stays stopped when calibration is finished or failed
+    if (ui8_calibration_state != CALIBRATION_STATE_RUNNING) {
+        return;
+    }
+
+    // abort if brake is applied
+    if (ui8_brake_state) {
+        ui8_calibration_state = CALIBRATION_STATE_ERROR;
+        return;
+    }
+
+    // closed loop ERPS control at the current set-point
+    ui8_erps_target = (uint8_t)(HALL_CALIBRATION_ERPS_MIN + (ui8_hall_calibration_point * HALL_CALIBRATION_ERPS_STEP));
+    ui8_riding_mode_parameter = ui8_erps_target;
+    apply_erps_calibration_assist();
+
+    // check if set-point is reached in time
+    if (++ui8_hall_calibration_timeout > HALL_CALIBRATION_TIMEOUT) {
+        ui8_calibration_state = CALIBRATION_STATE_ERROR;
+        return;
+    }
+
+    if (ui16_motor_speed_erps > ui8_erps_target) {
+        ui16_erps_error = ui16_motor_speed_erps - ui8_erps_target;
+    } else {
+        ui16_erps_error = ui8_erps_target - ui16_motor_speed_erps;
+    }
+
+    // speed must be stable while settling and averaging, otherwise restart settling
+    if (ui16_erps_error > HALL_CALIBRATION_ERPS_TOLERANCE) {
+        ui8_hall_calibration_counter = 0;
+        return;
+    }
+
+    ui8_hall_calibration_counter++;
+
+    if (ui8_hall_calibration_counter <= HALL_CALIBRATION_SETTLE_COUNT) {
+        if (ui8_hall_calibration_counter == HALL_CALIBRATION_SETTLE_COUNT) {
+            for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+                ui32_hall_calibration_sum[ui8_i_hall] = 0;
+            }
+        }
+        return;
+    }
+
+    // sum Hall sector counts
+    hall_calib_cnt_read(ui16_hall_cnt);
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        ui32_hall_calibration_sum[ui8_i_hall] += ui16_hall_cnt[ui8_i_hall];
+    }
+
+    if (ui8_hall_calibration_counter < (HALL_CALIBRATION_SETTLE_COUNT + HALL_CALIBRATION_AVERAGE_COUNT)) {
+        return;
+    }
+
+    // store the averaged point: x = counts per electrical revolution, y = sector counts
+    ui16_total = 0;
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        ui16_hall_calibration_y[ui8_i_hall][ui8_hall_calibration_point] = (uint16_t)(ui32_hall_calibration_sum[ui8_i_hall] / HALL_CALIBRATION_AVERAGE_COUNT);
+        ui16_total += ui16_hall_calibration_y[ui8_i_hall][ui8_hall_calibration_point];
+    }
+    ui16_hall_calibration_x[ui8_hall_calibration_point] = ui16_total;
+
+    // next set-point
+    ui8_hall_calibration_counter = 0;
+    ui8_hall_calibration_timeout = 0;
+    if (++ui8_hall_calibration_point < HALL_CALIBRATION_POINTS) {
+        return;
+    }
+
+    // all set-points done: calculate and apply new Hall angles and counter offsets
+    if (hall_calibration_solve(HALL_CALIBRATION_POINTS, ui16_hall_calibration_x, ui16_hall_calibration_y)) {
+        for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+            ui8_hall_ref_angles_config[ui8_i_hall] = ui8_hall_calibration_angles[ui8_i_hall];
+            ui8_hall_ref_angles[ui8_i_hall] = ui8_hall_calibration_angles[ui8_i_hall];
+            ui8_hall_counter_offsets[ui8_i_hall] = ui8_hall_calibration_offsets[ui8_i_hall];
+            ui8_hall_counter_offsets_config[ui8_i_hall] = ui8_hall_calibration_offsets[ui8_i_hall];
+        }
+        hall_counter_offsets_adapt_reset();
+        ui8_calibration_state = CALIBRATION_STATE_DONE;
+    } else {
+        ui8_calibration_state = CALIBRATION_STATE_ERROR;
+    }
+}
+
+/*---------------------------------------------------------
+ NOTE: regarding Hall calibration solver
+
+ Fixed point port of HallCalibrationJava. For every Hall
+ sector a linear regression y = slope * x + intercept is
+ calculated, x is the Hall counter total of an electrical
+ revolution and y the sector count.
+ - slope x 256 is the sector width in angle steps: the
+   reference angles are the cumulated widths, centered on
+   the nominal positions, plus 30 degrees, plus rotor
+   offset, minus 90 degrees.
+ - intercept is the difference of the delays of the two
+   Hall edges delimiting the sector. The 6 equations are
+   dependent; the Java tool sets F1 = 0, solves the system
+   6 times with one equation dropped and averages. Walking
+   the edge chain F1 R3 F2 R1 F3 R2, with P(k) the sum of
+   the first k intercepts and S the sum of all of them, this
+   average is P(k) - k * S / 6. The result is shifted so the
+   average offset is the one of the configured offsets.
+ Results in ui8_hall_calibration_angles/offsets, returns 0
+ if the data is not valid.
+ ---------------------------------------------------------*/
+static uint8_t hall_calibration_solve(uint8_t ui8_points, uint16_t *ui16_x, uint16_t ui16_y[][HALL_CALIBRATION_POINTS]) {
+
+    uint8_t ui8_i_hall;
+    uint8_t ui8_i_point;
+    int32_t i32_sum_x = 0;
+    int32_t i32_sum_y;
+    int32_t i32_dx;
+    int32_t i32_sxx = 0;
+    int32_t i32_sxy;
+    int32_t i32_x_mean;
+    int32_t i32_y_mean;
+    int32_t i32_temp;
+    int32_t i32_intercept_x16[6];
+    int16_t i16_slope_x4096;
+    int16_t i16_angle_x16 = 0;
+    int16_t i16_angle_error_x16 = 0;
+    int16_t i16_angles_x16[6];
+    int32_t i32_chain_sum_x16 = 0;
+    int32_t i32_delay_sum_x16 = 0;
+    int32_t i32_delays_x16[6];
+    uint16_t ui16_offsets_sum = 0;
+
+    if (ui8_points < 2) {
+        return 0;
+    }
+
+    for (ui8_i_point = 0; ui8_i_point < ui8_points; ui8_i_point++) {
+        i32_sum_x += ui16_x[ui8_i_point];
+    }
+    i32_x_mean = i32_sum_x / ui8_points;
+
+    for (ui8_i_point = 0; ui8_i_point < ui8_points; ui8_i_point++) {
+        i32_dx = (int32_t)ui16_x[ui8_i_point] - i32_x_mean;
+        i32_sxx += i32_dx * i32_dx;
+    }
+
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        i32_sum_y = 0;
+        for (ui8_i_point = 0; ui8_i_point < ui8_points; ui8_i_point++) {
+            i32_sum_y += ui16_y[ui8_i_hall][ui8_i_point];
+        }
+        i32_y_mean = i32_sum_y / ui8_points;
+
+        i32_sxy = 0;
+        for (ui8_i_point = 0; ui8_i_point < ui8_points; ui8_i_point++) {
+            i32_dx = (int32_t)ui16_x[ui8_i_point] - i32_x_mean;
+            i32_sxy += i32_dx * ((int32_t)ui16_y[ui8_i_hall][ui8_i_point] - i32_y_mean);
+        }
+
+        // slope x 4096, keep operands in 32 bit range
+        i32_temp = i32_sxx;
+        while (i32_temp > 0x00FFFFFFL) {
+            i32_temp >>= 1;
+            i32_sxy >>= 1;
+        }
+        i32_temp >>= 6;
+        if (i32_temp == 0) {
+            return 0;
+        }
+        i32_temp = (i32_sxy << 6) / i32_temp;
+        if ((i32_temp < HALL_CALIBRATION_SLOPE_MIN_X4096) || (i32_temp > HALL_CALIBRATION_SLOPE_MAX_X4096)) {
+            return 0;
+        }
+        i16_slope_x4096 = (int16_t)i32_temp;
+
+        // intercept x 16
+        i32_intercept_x16[ui8_i_hall] = ((i32_sum_y << 12) - ((int32_t)i16_slope_x4096 * i32_sum_x)) / ((int16_t)ui8_points << 8);
+
+        // slope x 4096 is also the sector width in angle steps x 16 (256 steps per revolution)
+        if (ui8_i_hall) {
+            i16_angle_x16 += i16_slope_x4096;
+            i16_angle_error_x16 += i16_angle_x16 - (int16_t)(((uint16_t)ui8_i_hall << 12) / 6);
+        }
+        i16_angles_x16[ui8_i_hall] = i16_angle_x16;
+    }
+
+    // average error in regard to the reference positions
+    i16_angle_error_x16 /= 6;
+
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        // add 30 degrees, subtract the error, add rotor offset and subtract phase angle (90 degrees)
+        i16_angle_x16 = i16_angles_x16[ui8_i_hall] - i16_angle_error_x16 + (4096 / 12) + 8;
+        ui8_hall_calibration_angles[ui8_i_hall] = (uint8_t)((uint8_t)(i16_angle_x16 >> 4) + MOTOR_ROTOR_OFFSET_ANGLE - (uint8_t)64);
+    }
+
+    // edge delays along the chain F1 R3 F2 R1 F3 R2 (intercept index 2,3,4,5,0,1)
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        i32_chain_sum_x16 += i32_intercept_x16[ui8_i_hall];
+    }
+
+    i32_temp = 0;
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        i32_delays_x16[ui8_i_hall] = i32_temp - ((i32_chain_sum_x16 * ui8_i_hall) / 6);
+        i32_delay_sum_x16 += i32_delays_x16[ui8_i_hall];
+        i32_temp += i32_intercept_x16[(uint8_t)(ui8_i_hall + 2) % 6];
+    }
+
+    // shift to the average of the configured offsets
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        ui16_offsets_sum += ui8_hall_counter_offsets_config[ui8_i_hall];
+    }
+    i32_temp = (((int32_t)ui16_offsets_sum << 4) / 6) - (i32_delay_sum_x16 / 6) + 8;
+
+    // chain position k is the delay for Hall state index k + 1 (R2 -> 0, F1 -> 1, R3 -> 2 ...)
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        i32_delays_x16[ui8_i_hall] += i32_temp;
+        if ((i32_delays_x16[ui8_i_hall] < 0) || (i32_delays_x16[ui8_i_hall] > (255L << 4))) {
+            return 0;
+        }
+        ui8_hall_calibration_offsets[(uint8_t)(ui8_i_hall + 1) % 6] = (uint8_t)(i32_delays_x16[ui8_i_hall] >> 4);
+    }
+
+    return 1;
+}
+
+/*---------------------------------------------------------
+ NOTE: regarding angle sweep
+
+ Runs the motor in closed ERPS loop while a global offset
+ (i8_start + n * i8_step, n < ui8_points) is added to the
+ configured Hall reference angles. At every offset the
+ filtered battery current is averaged once the speed is
+ stable. A parabola through the lowest current point and its
+ two neighbours gives the offset of minimum current, stored
+ in i16_angle_sweep_result_x16 (angle steps x 16), the
+ motor phase current at that point in
+ ui8_angle_sweep_phase_current_result.
+ Call every loop, ui8_angle_sweep_step = 0 starts a sweep.
+ ---------------------------------------------------------*/
+static uint8_t angle_sweep(uint8_t ui8_erps_target, int8_t i8_start, int8_t i8_step, uint8_t ui8_points) {
+
+    uint8_t ui8_i;
+    uint8_t ui8_min;
+    int8_t i8_offset;
+    uint16_t ui16_erps_error;
+    int16_t i16_num;
+    int16_t i16_den;
+
+    // apply the offset of the current step
+    i8_offset = i8_start + (int8_t)(ui8_angle_sweep_step * i8_step);
+    for (ui8_i = 0; ui8_i < 6; ui8_i++) {
+        ui8_hall_ref_angles[ui8_i] = ui8_hall_ref_angles_config[ui8_i] + (uint8_t)i8_offset;
+    }
+
+    // closed loop ERPS control
+    ui8_riding_mode_parameter = ui8_erps_target;
+    apply_erps_calibration_assist();
+
+    if (++ui8_angle_sweep_timeout > HALL_CALIBRATION_TIMEOUT) {
+        // restore configured angles
+        for (ui8_i = 0; ui8_i < 6; ui8_i++) {
+            ui8_hall_ref_angles[ui8_i] = ui8_hall_ref_angles_config[ui8_i];
+        }
+        return CALIBRATION_STATE_ERROR;
+    }
+
+    if (ui16_motor_speed_erps > ui8_erps_target) {
+        ui16_erps_error = ui16_motor_speed_erps - ui8_erps_target;
+    } else {
+        ui16_erps_error = ui8_erps_target - ui16_motor_speed_erps;
+    }
+
+    // speed must be stable while settling and averaging, otherwise restart settling
+    if (ui16_erps_error > HALL_CALIBRATION_ERPS_TOLERANCE) {
+        ui8_angle_sweep_counter = 0;
+        return CALIBRATION_STATE_RUNNING;
+    }
+
+    if (++ui8_angle_sweep_counter <= HALL_CALIBRATION_SETTLE_COUNT) {
+        ui16_angle_sweep_current_sum = 0;
+        ui16_angle_sweep_phase_current_sum = 0;
+        return CALIBRATION_STATE_RUNNING;
+    }
+
+    ui16_angle_sweep_current_sum += ui8_adc_battery_current_filtered;
+    ui16_angle_sweep_phase_current_sum += ui8_adc_motor_phase_current;
+
+    if (ui8_angle_sweep_counter < (HALL_CALIBRATION_SETTLE_COUNT + ANGLE_SWEEP_AVERAGE_COUNT)) {
+        return CALIBRATION_STATE_RUNNING;
+    }
+
+    ui16_angle_sweep_current[ui8_angle_sweep_step] = ui16_angle_sweep_current_sum;
+    ui16_angle_sweep_phase_current[ui8_angle_sweep_step] = ui16_angle_sweep_phase_current_sum;
+    ui8_angle_sweep_counter = 0;
+    ui8_angle_sweep_timeout = 0;
+
+    if (++ui8_angle_sweep_step < ui8_points) {
+        return CALIBRATION_STATE_RUNNING;
+    }
+
+    // restore configured angles
+    for (ui8_i = 0; ui8_i < 6; ui8_i++) {
+        ui8_hall_ref_angles[ui8_i] = ui8_hall_ref_angles_config[ui8_i];
+    }
+
+    // lowest current point
+    ui8_min = 0;
+    for (ui8_i = 1; ui8_i < ui8_points; ui8_i++) {
+        if (ui16_angle_sweep_current[ui8_i] < ui16_angle_sweep_current[ui8_min]) {
+            ui8_min = ui8_i;
+        }
+    }
+
+    i16_angle_sweep_result_x16 = (int16_t)(i8_start + (int8_t)(ui8_min * i8_step)) << 4;
+    ui8_angle_sweep_phase_current_result = (uint8_t)(ui16_angle_sweep_phase_current[ui8_min] / ANGLE_SWEEP_AVERAGE_COUNT);
+
+    // parabola vertex, the minimum at the sweep edges is used as is
+    if ((ui8_min > 0) && (ui8_min < (uint8_t)(ui8_points - 1))) {
+        i16_num = (int16_t)ui16_angle_sweep_current[ui8_min - 1] - (int16_t)ui16_angle_sweep_current[ui8_min + 1];
+        i16_den = (int16_t)ui16_angle_sweep_current[ui8_min - 1] - ((int16_t)ui16_angle_sweep_current[ui8_min] << 1)
+                + (int16_t)ui16_angle_sweep_current[ui8_min + 1];
+        if (i16_den > 0) {
+            i16_angle_sweep_result_x16 += (int16_t)(((int32_t)i16_num * (i8_step << 3)) / i16_den);
+        }
+    }
+
+    return CALIBRATION_STATE_DONE;
+}
+
+static void apply_rotor_offset_calibration() {
+
+    uint8_t ui8_i;
+
+    if (ui8_calibration_state != CALIBRATION_STATE_RUNNING) {
+        return;
+    }
+
+    // abort if brake is applied
+    if (ui8_brake_state) {
+        ui8_calibration_state = CALIBRATION_STATE_ERROR;
+    } else {
+        ui8_calibration_state = angle_sweep(ui8_calibration_erps_target, ROTOR_OFFSET_SWEEP_START, ROTOR_OFFSET_SWEEP_STEP, ROTOR_OFFSET_SWEEP_POINTS);
+    }
+
+    switch (ui8_calibration_state) {
+      case CALIBRATION_STATE_DONE:
+        // apply the offset of minimum battery current
+        i8_rotor_offset_calibration_result = (int8_t)((i16_angle_sweep_result_x16 + 8) >> 4);
+        for (ui8_i = 0; ui8_i < 6; ui8_i++) {
+            ui8_hall_ref_angles_config[ui8_i] += (uint8_t)i8_rotor_offset_calibration_result;
+            ui8_hall_ref_angles[ui8_i] = ui8_hall_ref_angles_config[ui8_i];
+        }
+        break;
+
+      case CALIBRATION_STATE_ERROR:
+        for (ui8_i = 0; ui8_i < 6; ui8_i++) {
+            ui8_hall_ref_angles[ui8_i] = ui8_hall_ref_angles_config[ui8_i];
+        }
+        break;
+    }
+}
+
+/*---------------------------------------------------------
+ NOTE: regarding FOC angle multiplicator calibration
+
+ With the FOC angle disabled, the best angle advance (angle
+ sweep of minimum battery current) is found at several ERPS,
+ each one with its own no-load phase current. The ISR uses
+ foc angle = phase current * multiplicator / 256, so the
+ multiplicator is the least squares line through the origin:
+ multiplicator = 256 * sum(angle * current) / sum(current^2)
+ ---------------------------------------------------------*/
+static void apply_foc_calibration() {
+
+    uint8_t ui8_i;
+    int32_t i32_sum_xy = 0;
+    int32_t i32_sum_xx = 0;
+    int32_t i32_multiplicator;
+
+    if (ui8_calibration_state != CALIBRATION_STATE_RUNNING) {
+        return;
+    }
+
+    // abort if brake is applied
+    if (ui8_brake_state) {
+        ui8_calibration_state = CALIBRATION_STATE_ERROR;
+        for (ui8_i = 0; ui8_i < 6; ui8_i++) {
+            ui8_hall_ref_angles[ui8_i] = ui8_hall_ref_angles_config[ui8_i];
+        }
+        return;
+    }
+
+    // angle sweep disables FOC angle (multiplicator = 0) with the ERPS calibration control
+    ui8_calibration_state = angle_sweep((uint8_t)(FOC_CALIBRATION_ERPS_MIN + (ui8_foc_calibration_point * FOC_CALIBRATION_ERPS_STEP)),
+            FOC_CALIBRATION_SWEEP_START, FOC_CALIBRATION_SWEEP_STEP, FOC_CALIBRATION_SWEEP_POINTS);
+
+    if (ui8_calibration_state == CALIBRATION_STATE_RUNNING) {
+        return;
+    }
+    if (ui8_calibration_state != CALIBRATION_STATE_DONE) {
+        // angle sweep failed: configured angles
+        for (ui8_i = 0; ui8_i < 6; ui8_i++) {
+            ui8_hall_ref_angles[ui8_i] = ui8_hall_ref_angles_config[ui8_i];
+        }
+        return;
+    }
+
+    // store the load point and start the next sweep
+    i16_foc_calibration_angle_x16[ui8_foc_calibration_point] = i16_angle_sweep_result_x16;
+    ui8_foc_calibration_phase_current[ui8_foc_calibration_point] = ui8_angle_sweep_phase_current_result;
+    ui8_angle_sweep_step = 0;
+
+    if (++ui8_foc_calibration_point < FOC_CALIBRATION_POINTS) {
+        ui8_calibration_state = CALIBRATION_STATE_RUNNING;
+        return;
+    }
+
+    for (ui8_i = 0; ui8_i < FOC_CALIBRATION_POINTS; ui8_i++) {
+        i32_sum_xy += (int32_t)i16_foc_calibration_angle_x16[ui8_i] * ui8_foc_calibration_phase_current[ui8_i];
+        i32_sum_xx += (uint16_t)ui8_foc_calibration_phase_current[ui8_i] * ui8_foc_calibration_phase_current[ui8_i];
+    }
+
+    if (!i32_sum_xx) {
+        ui8_calibration_state = CALIBRATION_STATE_ERROR;
+        return;
+    }
+
+    // angle is x16: 256 / 16 = 16
+    i32_multiplicator = ((i32_sum_xy << 4) + (i32_sum_xx >> 1)) / i32_sum_xx;
+    if (i32_multiplicator < 0) {
+        i32_multiplicator = 0;
+    } else if (i32_multiplicator > 255) {
+        i32_multiplicator = 255;
+    }
+
+    ui8_foc_angle_multiplicator_calibrated = (uint8_t)i32_multiplicator;
+    m_configuration_variables.ui8_foc_angle_multiplicator = ui8_foc_angle_multiplicator_calibrated;
+}
+
+static void hall_counter_offsets_adapt_reset(void) {
+    ui16_hall_adapt_samples[0] = 0;
+    ui16_hall_adapt_samples[1] = 0;
+    ui16_hall_adapt_update_counter = 0;
+    ui8_hall_adapt_estimate_valid = 0;
+}
+
+static void hall_counter_offsets_adapt(void) {
+
+    uint8_t ui8_i_hall;
+    uint8_t ui8_bin;
+    uint16_t ui16_total;
+    uint16_t ui16_hall_cnt[6];
+    uint16_t ui16_erps = ui16_motor_speed_erps;
+    uint16_t ui16_erps_old = ui16_hall_adapt_erps_old;
+    uint8_t ui8_offset;
+    uint8_t ui8_offset_min;
+    uint8_t ui8_offset_max;
+
+    ui16_hall_adapt_erps_old = ui16_erps;
+
+    // only while riding with the motor driven at steady speed
+    if ((ui8_riding_mode == OFF_MODE)
+            || (ui8_riding_mode >= PWM_CALIBRATION_ASSIST_MODE)
+            || (!ui8_motor_enabled)
+            || (ui8_brake_state)
+            || (!ui8_g_duty_cycle)
+            || (ui16_erps < HALL_ADAPT_ERPS_MIN)
+            || (ui16_erps >= MOTOR_OVER_SPEED_ERPS)
+            || ((ui16_erps > ui16_erps_old) && ((ui16_erps - ui16_erps_old) > HALL_ADAPT_ERPS_DELTA_MAX))
+            || ((ui16_erps_old > ui16_erps) && ((ui16_erps_old - ui16_erps) > HALL_ADAPT_ERPS_DELTA_MAX))) {
+        return;
+    }
+
+    ui16_total = 0;
+    hall_calib_cnt_read(ui16_hall_cnt);
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        ui16_total += ui16_hall_cnt[ui8_i_hall];
+    }
+
+    // sector counts must be consistent with the measured speed
+    if ((ui16_total > (uint16_t)(HALL_COUNTER_FREQ / HALL_ADAPT_ERPS_MIN) + (uint16_t)(HALL_COUNTER_FREQ / HALL_ADAPT_ERPS_MIN / 8))
+            || (ui16_total < (uint16_t)(HALL_COUNTER_FREQ / MOTOR_OVER_SPEED_ERPS))) {
+        return;
+    }
+
+    // exponential average, x and y averaged together keep the linear relation
+    ui8_bin = (ui16_erps >= HALL_ADAPT_ERPS_BIN) ? 1 : 0;
+    if (ui16_hall_adapt_samples[ui8_bin] == 0) {
+        i32_hall_adapt_x_x256[ui8_bin] = (int32_t)ui16_total << 8;
+        for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+            i32_hall_adapt_y_x256[ui8_bin][ui8_i_hall] = (int32_t)ui16_hall_cnt[ui8_i_hall] << 8;
+        }
+    } else {
+        i32_hall_adapt_x_x256[ui8_bin] += (((int32_t)ui16_total << 8) - i32_hall_adapt_x_x256[ui8_bin]) >> HALL_ADAPT_FILTER_SHIFT;
+        for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+            i32_hall_adapt_y_x256[ui8_bin][ui8_i_hall] += (((int32_t)ui16_hall_cnt[ui8_i_hall] << 8)
+                    - i32_hall_adapt_y_x256[ui8_bin][ui8_i_hall]) >> HALL_ADAPT_FILTER_SHIFT;
+        }
+    }
+    if (ui16_hall_adapt_samples[ui8_bin] < 0xFFFF) {
+        ui16_hall_adapt_samples[ui8_bin]++;
+    }
+
+    if ((++ui16_hall_adapt_update_counter < HALL_ADAPT_UPDATE_COUNT)
+            || (ui16_hall_adapt_samples[0] < HALL_ADAPT_SAMPLES_MIN)
+            || (ui16_hall_adapt_samples[1] < HALL_ADAPT_SAMPLES_MIN)) {
+        return;
+    }
+    ui16_hall_adapt_update_counter = 0;
+
+    // estimate offsets from the two averaged points (calibration buffers are free while riding)
+    for (ui8_bin = 0; ui8_bin < 2; ui8_bin++) {
+        ui16_hall_calibration_x[ui8_bin] = (uint16_t)((i32_hall_adapt_x_x256[ui8_bin] + 128) >> 8);
+        for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+            ui16_hall_calibration_y[ui8_i_hall][ui8_bin] = (uint16_t)((i32_hall_adapt_y_x256[ui8_bin][ui8_i_hall] + 128) >> 8);
+        }
+    }
+    if (ui16_hall_calibration_x[0] < (ui16_hall_calibration_x[1] + HALL_ADAPT_X_SPREAD_MIN)) {
+        return;
+    }
+    ui8_hall_adapt_estimate_valid = hall_calibration_solve(2, ui16_hall_calibration_x, ui16_hall_calibration_y);
+    if (!ui8_hall_adapt_estimate_valid) {
+        return;
+    }
+
+    // one step toward the estimate, within safe bounds around the configured offsets
+    for (ui8_i_hall = 0; ui8_i_hall < 6; ui8_i_hall++) {
+        ui8_offset = ui8_hall_counter_offsets[ui8_i_hall];
+        ui8_offset_min = ui8_hall_counter_offsets_config[ui8_i_hall];
+        ui8_offset_min = (ui8_offset_min > HALL_COUNTER_OFFSET_ADAPT_MAX) ? (ui8_offset_min - HALL_COUNTER_OFFSET_ADAPT_MAX) : 0;
+        ui8_offset_max = ui8_hall_counter_offsets_config[ui8_i_hall];
+        ui8_offset_max = (ui8_offset_max < (255 - HALL_COUNTER_OFFSET_ADAPT_MAX)) ? (ui8_offset_max + HALL_COUNTER_OFFSET_ADAPT_MAX) : 255;
+
+        if ((ui8_hall_calibration_offsets[ui8_i_hall] > ui8_offset) && (ui8_offset < ui8_offset_max)) {
+            ui8_offset++;
+        } else if ((ui8_hall_calibration_offsets[ui8_i_hall] < ui8_offset) && (ui8_offset > ui8_offset_min)) {
+            ui8_offset--;
+        }
+        ui8_hall_counter_offsets[ui8_i_hall] = ui8_offset;
+    }
+}
+
+static void motor_parameters_estimate_reset(void) {
+    ui16_motor_estimate_samples[0] = 0;
+    ui16_motor_estimate_samples[1] = 0;
+    ui16_motor_estimate_update_counter = 0;
+    ui8_motor_estimate_valid = 0;
+    ui16_motor_r_winding_x16 = 0;
+    ui16_motor_r_winding_reference_x16 = 0;
+    ui8_motor_winding_temperature_rise = 0;
+}
+
+static void motor_parameters_estimate(void) {
+
+    uint8_t ui8_bin;
+    uint8_t ui8_duty_cycle = ui8_g_duty_cycle;
+    uint8_t ui8_duty_cycle_old = ui8_motor_estimate_duty_cycle_old;
+    uint16_t ui16_erps = ui16_motor_speed_erps;
+    uint16_t ui16_erps_old = ui16_motor_estimate_erps_old;
+    uint16_t ui16_phase_current;
+    uint16_t ui16_k_min;
+    uint16_t ui16_k_max;
+    int32_t i32_erps[2];
+    int32_t i32_current[2];
+    int32_t i32_voltage[2];
+    int32_t i32_det;
+    int32_t i32_k;
+    int32_t i32_r;
+    uint8_t ui8_r_winding;
+    uint16_t ui16_rise;
+
+    ui16_motor_estimate_erps_old = ui16_erps;
+    ui8_motor_estimate_duty_cycle_old = ui8_duty_cycle;
+
+    // only while riding with the motor driven at steady speed and duty cycle, without field weakening
+    if ((ui8_riding_mode == OFF_MODE)
+            || (ui8_riding_mode >= PWM_CALIBRATION_ASSIST_MODE)
+            || (!ui8_motor_enabled)
+            || (ui8_brake_state)
+            || (ui8_fw_hall_counter_offset)
+            || (!ui8_duty_cycle)
+            || (ui8_duty_cycle >= PWM_DUTY_CYCLE_MAX)
+            || (!ui16_adc_battery_voltage_filtered)
+            || (ui16_erps < MOTOR_ESTIMATE_ERPS_MIN)
+            || (ui16_erps >= MOTOR_OVER_SPEED_ERPS)
+            || ((ui16_erps > ui16_erps_old) && ((ui16_erps - ui16_erps_old) > MOTOR_ESTIMATE_ERPS_DELTA_MAX))
+            || ((ui16_erps_old > ui16_erps) && ((ui16_erps_old - ui16_erps) > MOTOR_ESTIMATE_ERPS_DELTA_MAX))
+            || ((ui8_duty_cycle > ui8_duty_cycle_old) && ((uint8_t)(ui8_duty_cycle - ui8_duty_cycle_old) > MOTOR_ESTIMATE_DUTY_CYCLE_DELTA_MAX))
+            || ((ui8_duty_cycle_old > ui8_duty_cycle) && ((uint8_t)(ui8_duty_cycle_old - ui8_duty_cycle) > MOTOR_ESTIMATE_DUTY_CYCLE_DELTA_MAX))) {
+        return;
+    }
+
+    // phase current from the battery current (same power), ADC steps
+    ui16_phase_current = ((uint16_t)ui8_adc_battery_current_filtered << 8) / ui8_duty_cycle;
+    if (ui16_phase_current > 255) {
+        return;
+    }
+
+    // exponential average, the three values averaged together keep the linear relation
+    ui8_bin = (ui16_phase_current >= MOTOR_ESTIMATE_PHASE_CURRENT_BIN) ? 1 : 0;
+    if (ui16_motor_estimate_samples[ui8_bin] == 0) {
+        i32_motor_estimate_erps_x256[ui8_bin] = (int32_t)ui16_erps << 8;
+        i32_motor_estimate_current_x256[ui8_bin] = (int32_t)ui16_phase_current << 8;
+        i32_motor_estimate_voltage_x256[ui8_bin] = ((int32_t)ui8_duty_cycle * ui16_adc_battery_voltage_filtered) << 8;
+    } else {
+        i32_motor_estimate_erps_x256[ui8_bin] += (((int32_t)ui16_erps << 8)
+                - i32_motor_estimate_erps_x256[ui8_bin]) >> MOTOR_ESTIMATE_FILTER_SHIFT;
+        i32_motor_estimate_current_x256[ui8_bin] += (((int32_t)ui16_phase_current << 8)
+                - i32_motor_estimate_current_x256[ui8_bin]) >> MOTOR_ESTIMATE_FILTER_SHIFT;
+        i32_motor_estimate_voltage_x256[ui8_bin] += ((((int32_t)ui8_duty_cycle * ui16_adc_battery_voltage_filtered) << 8)
+                - i32_motor_estimate_voltage_x256[ui8_bin]) >> MOTOR_ESTIMATE_FILTER_SHIFT;
+    }
+    if (ui16_motor_estimate_samples[ui8_bin] < 0xFFFF) {
+        ui16_motor_estimate_samples[ui8_bin]++;
+    }
+
+    if ((++ui16_motor_estimate_update_counter < MOTOR_ESTIMATE_UPDATE_COUNT)
+            || (ui16_motor_estimate_samples[0] < MOTOR_ESTIMATE_SAMPLES_MIN)
+            || (ui16_motor_estimate_samples[1] < MOTOR_ESTIMATE_SAMPLES_MIN)) {
+        return;
+    }
+    ui16_motor_estimate_update_counter = 0;
+
+    // solve voltage = K * ERPS + R * current from the two averaged points
+    for (ui8_bin = 0; ui8_bin < 2; ui8_bin++) {
+        i32_erps[ui8_bin] = (i32_motor_estimate_erps_x256[ui8_bin] + 128) >> 8;
+        i32_current[ui8_bin] = (i32_motor_estimate_current_x256[ui8_bin] + 128) >> 8;
+        i32_voltage[ui8_bin] = (i32_motor_estimate_voltage_x256[ui8_bin] + 128) >> 8;
+    }
+    i32_det = (i32_erps[0] * i32_current[1]) - (i32_erps[1] * i32_current[0]);
+    if ((i32_det < MOTOR_ESTIMATE_DET_MIN) && (i32_det > -MOTOR_ESTIMATE_DET_MIN)) {
+        return;
+    }
+    i32_k = ((i32_voltage[0] * i32_current[1]) - (i32_voltage[1] * i32_current[0])) / i32_det;
+    i32_r = ((i32_erps[0] * i32_voltage[1]) - (i32_erps[1] * i32_voltage[0])) / i32_det;
+
+    // discard estimates far from the motor type values
+    ui16_k_min = ui16_motor_launch_duty_k - (uint16_t)((ui16_motor_launch_duty_k * MOTOR_ESTIMATE_K_RANGE_PERCENT) / 100);
+    ui16_k_max = ui16_motor_launch_duty_k + (uint16_t)((ui16_motor_launch_duty_k * MOTOR_ESTIMATE_K_RANGE_PERCENT) / 100);
+    if ((i32_k < ui16_k_min) || (i32_k > ui16_k_max) || (i32_r <= 0) || (i32_r > MOTOR_ESTIMATE_R_MAX)) {
+        return;
+    }
+
+    // filter the estimates
+    if (!ui8_motor_estimate_valid) {
+        ui16_motor_k_estimate = (uint16_t)i32_k;
+        ui8_motor_r_estimate = (uint8_t)i32_r;
+        ui8_motor_estimate_valid = 1;
+    } else {
+        ui16_motor_k_estimate = (uint16_t)(((ui16_motor_k_estimate * 3U) + (uint16_t)i32_k + 2) >> 2);
+        ui8_motor_r_estimate = (uint8_t)((((uint16_t)ui8_motor_r_estimate * 3U) + (uint16_t)i32_r + 2) >> 2);
+    }
+
+    // winding temperature rise (see NOTE in main.h): implausible steps of the R estimate discarded
+    ui8_r_winding = (uint8_t)(ui16_motor_r_winding_x16 >> 4);
+    if (!ui16_motor_r_winding_x16) {
+        ui16_motor_r_winding_x16 = (uint16_t)ui8_motor_r_estimate << 4;
+    } else if (((ui8_motor_r_estimate > ui8_r_winding) && ((uint8_t)(ui8_motor_r_estimate - ui8_r_winding) > MOTOR_WINDING_R_STEP_MAX))
+            || ((ui8_r_winding > ui8_motor_r_estimate) && ((uint8_t)(ui8_r_winding - ui8_motor_r_estimate) > MOTOR_WINDING_R_STEP_MAX))) {
+        return;
+    } else {
+        ui16_motor_r_winding_x16 = (uint16_t)((int16_t)ui16_motor_r_winding_x16
+                + (((int16_t)((uint16_t)ui8_motor_r_estimate << 4) - (int16_t)ui16_motor_r_winding_x16) >> MOTOR_WINDING_R_FILTER_SHIFT));
+    }
+    // reference: lowest resistance since power on (coldest winding)
+    if ((!ui16_motor_r_winding_reference_x16) || (ui16_motor_r_winding_x16 < ui16_motor_r_winding_reference_x16)) {
+        ui16_motor_r_winding_reference_x16 = ui16_motor_r_winding_x16;
+    }
+    // copper 0.39%/degC: 1 degC every R/255
+    ui16_rise = (uint16_t)((((uint32_t)(ui16_motor_r_winding_x16 - ui16_motor_r_winding_reference_x16)) * 255U)
+            / ui16_motor_r_winding_reference_x16);
+    if (ui16_rise > MOTOR_WINDING_TEMPERATURE_RISE_MAX) {
+        // implausible: keep the last value
+        return;
+    }
+    // hysteresis on the decrease
+    if ((ui16_rise > ui8_motor_winding_temperature_rise)
+            || ((ui16_rise + MOTOR_WINDING_TEMPERATURE_HYSTERESIS) < ui8_motor_winding_temperature_rise)) {
+        ui8_motor_winding_temperature_rise = (uint8_t)ui16_rise;
+    }
+}
 
 static void apply_temperature_limiting() 
 {
@@ -1200,6 +2157,30 @@ static void apply_temperature_limiting()
     }
 }
 
+#ifdef MOTOR_WINDING_TEMPERATURE_LIMIT
+// no temperature sensor: motor temperature from the winding temperature rise (resistance estimate)
+static void apply_winding_temperature_limiting(void)
+{
+    uint8_t ui8_temperature;
+
+    // limits not set by the display: no limiting
+    if ((!ui8_motor_estimate_valid)
+            || (ui8_motor_temperature_min_value_to_limit >= ui8_motor_temperature_max_value_to_limit)) {
+        return;
+    }
+
+    // rise limited by MOTOR_WINDING_TEMPERATURE_RISE_MAX
+    ui8_temperature = MOTOR_ESTIMATE_TEMPERATURE_REFERENCE + ui8_motor_winding_temperature_rise;
+
+    // adjust target current if motor over temperature limit
+    ui8_adc_battery_current_target = map_ui8(ui8_temperature,
+        ui8_motor_temperature_min_value_to_limit,
+        ui8_motor_temperature_max_value_to_limit,
+        ui8_adc_battery_current_target,
+        0);
+}
+#endif
+
 static void apply_speed_limit() 
 {
     if (m_configuration_variables.ui8_wheel_speed_max > 0) {
@@ -1223,35 +2204,210 @@ static void apply_speed_limit()
 static void calc_wheel_speed(void) 
 {
     // calc wheel speed (km/h*10)
-    if (ui16_wheel_speed_sensor_ticks) {
-        uint16_t ui16_tmp = ui16_wheel_speed_sensor_ticks >> 5;
-        // rps = PWM_CYCLES_SECOND / ui16_wheel_speed_sensor_ticks (rev/sec)
+    uint16_t ui16_tmp = ui16_wheel_speed_sensor_ticks;
+    if (ui16_tmp) {
+        // no pulse yet after the last period: the speed is at most the one of the elapsed time
+        uint16_t ui16_elapsed = wheel_speed_sensor_elapsed_ticks();
+        if (ui16_elapsed > ui16_tmp)
+            ui16_tmp = ui16_elapsed;
+        // rps = WHEEL_SPEED_SENSOR_TICKS_SECOND / (ui16_wheel_speed_sensor_ticks * pulses per revolution) (rev/sec)
         // km/h*10 = rps * ui16_wheel_perimeter * ((3600 / (1000 * 1000)) * 10)
-        // !!!warning if PWM_CYCLES_SECOND is not a multiple of 1000
-        ui16_wheel_speed_x10 =  ui16_wheel_calc_const / ui16_tmp;
+        ui16_wheel_speed_x10 = (uint16_t)(ui32_wheel_calc_const / ui16_tmp);
     } else {
         ui16_wheel_speed_x10 = 0;
     }
 }
 
-static void calc_cadence(void) 
+/*
+ * - Pedal start/stop detection Algorithm (by MSpider65) -
+ *
+ * Pedal start/stop detection uses both transitions of both PAS sensors
+ * ui8_state stores the PAS1 and PAS2 state: bit0=PAS1,  bit1=PAS2
+ * Pedal forward ui8_state sequence is: 0x01 -> 0x00 -> 0x02 -> 0x03 -> 0x01
+ * All transitions resets the stop detection (much faster stop detection)
+ *
+ * Cadence from every forward transition (80 for each crank revolution), moving window of
+ * the last 4 transitions (one PAS period):
+ * - 4 transitions: PAS period from the last transition of the same state, no phase error.
+ *   The part of the period of each quarter is learned (magnets and sensors position)
+ * - 1 to 3 transitions (start): window time divided by the learned parts of its quarters,
+ *   cadence valid from the second forward transition
+ */
+static void cadence_pas_transition(uint8_t ui8_state, uint32_t ui32_time)
+{
+    uint32_t ui32_ticks;
+    uint32_t ui32_quarter;
+    uint16_t ui16_window_x256;
+    uint8_t ui8_i;
+    uint8_t ui8_old_state;
+
+    // no transition for more than the counter min: pedals stop detected
+    if (((ui32_time - ui32_pas_transition_time) >> CADENCE_SENSOR_TICKS_SHIFT) > ui16_cadence_sensor_ticks_counter_min) {
+        ui16_cadence_sensor_ticks = 0;
+        ui8_cadence_calc_ref_state = NO_PAS_REF;
+        ui8_pas_transitions = 0;
+    }
+
+    if (ui8_state != ui8_pas_state_old) {
+        if (ui8_pas_state_old != ui8_pas_old_valid_state[ui8_state]) {
+            // wrong state sequence: backward rotation (or lost edge)
+            ui16_cadence_sensor_ticks = 0;
+            ui8_cadence_calc_ref_state = NO_PAS_REF;
+            ui8_pas_transitions = 0;
+        } else {
+            // pull in counter value from speed
+            ui16_cadence_sensor_ticks_counter_min = ui16_cadence_ticks_count_min_speed_adj;
+
+            // Reference state for crank revolution counter increment
+            if (ui8_state == 0)
+                ui32_crank_revolutions_x20++;
+
+            if (ui8_pas_transitions >= 4) {
+                // PAS period: time from the last transition to the same state
+                ui32_ticks = ui32_time - ui32_pas_edge_time[ui8_state];
+                // learn the part of the period of this quarter (filtered)
+                ui32_quarter = ((ui32_time - ui32_pas_edge_time[ui8_pas_state_old]) << 8) / ui32_ticks;
+                if (ui32_quarter > 255)
+                    ui32_quarter = 255;
+                else if (ui32_quarter < 16)
+                    ui32_quarter = 16;
+                ui8_pas_quarter_x256[ui8_state] = (uint8_t)((((uint16_t)ui8_pas_quarter_x256[ui8_state] * 3U) + (uint16_t)ui32_quarter) >> 2);
+            } else if (ui8_pas_transitions) {
+                // start: window of the transitions from the stop, scaled by the parts of its quarters
+                ui16_window_x256 = 0;
+                ui8_old_state = ui8_state;
+                for (ui8_i = 0; ui8_i < ui8_pas_transitions; ui8_i++) {
+                    ui16_window_x256 += ui8_pas_quarter_x256[ui8_old_state];
+                    ui8_old_state = ui8_pas_old_valid_state[ui8_old_state];
+                }
+                ui32_ticks = ((ui32_time - ui32_pas_edge_time[ui8_old_state]) << 8) / ui16_window_x256;
+            } else {
+                ui32_ticks = 0;
+            }
+
+            if (ui32_ticks) {
+                ui32_ticks >>= CADENCE_SENSOR_TICKS_SHIFT;
+                ui16_cadence_sensor_ticks = (ui32_ticks > 0xffff) ? 0xffff : (uint16_t)ui32_ticks;
+                // software based Schmitt trigger to stop motor jitter when at resolution limits
+                ui16_cadence_sensor_ticks_counter_min += CADENCE_SENSOR_STANDARD_MODE_SCHMITT_TRIGGER_THRESHOLD;
+            }
+
+            if (ui8_state == ui8_cadence_calc_ref_state) {
+                // one PAS period from the first transition after the stop
+                torque_samples_reset();
+            } else {
+                if (ui8_cadence_calc_ref_state == NO_PAS_REF)
+                    ui8_cadence_calc_ref_state = ui8_state;
+                new_torque_sample();
+            }
+
+            ui32_pas_edge_time[ui8_state] = ui32_time;
+            if (ui8_pas_transitions < 4)
+                ui8_pas_transitions++;
+        }
+        // reset the time used to detect pedal stop
+        ui32_pas_transition_time = ui32_time;
+        // save current PAS state
+        ui8_pas_state_old = ui8_state;
+    }
+}
+
+// TIM3 read by a single instruction (the PAS2 TLI reads TIM3 and can't be masked)
+static void pas_timer_update(void)
 {
-    // get the cadence sensor ticks
-    uint16_t ui16_cadence_sensor_ticks_temp = ui16_cadence_sensor_ticks;
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        pushw x
+        ldw x, 0x5328                       // TIM3->CNTRH, TIM3->CNTRL
+        ldw _ui16_pas_timer_now+0, x
+        popw x
+    __endasm;
+    #endif
+    // 32 bits time base: called at least every 30ms, TIM3 wraps every 262ms
+    ui32_pas_timer += (uint16_t)(ui16_pas_timer_now - ui16_pas_timer_old);
+    ui16_pas_timer_old = ui16_pas_timer_now;
+}
+
+// PAS edges of the FIFOs: cadence and torque sample at every forward transition, called by the main loop
+void pas_edges_process(void)
+{
+    uint8_t ui8_pas1_write_index;
+    uint8_t ui8_pas2_write_index;
+    uint8_t ui8_state;
+    uint16_t ui16_timestamp;
+    uint16_t ui16_timestamp2;
+
+    // PAS edges stored up to now: all timestamps are before the TIM3 value read next
+    ui8_pas1_write_index = ui8_pas1_fifo_write_index;
+    ui8_pas2_write_index = ui8_pas2_fifo_write_index;
+    if ((ui8_pas1_write_index == ui8_pas1_fifo_read_index) && (ui8_pas2_write_index == ui8_pas2_fifo_read_index))
+        return;
+
+    pas_timer_update();
+
+    if (((uint8_t)(ui8_pas1_write_index - ui8_pas1_fifo_read_index) > PAS_FIFO_SIZE)
+            || ((uint8_t)(ui8_pas2_write_index - ui8_pas2_fifo_read_index) > PAS_FIFO_SIZE)) {
+        // FIFO overflow (edges lost): restart the cadence calculation
+        ui8_pas1_fifo_read_index = ui8_pas1_write_index;
+        ui8_pas2_fifo_read_index = ui8_pas2_write_index;
+        ui16_cadence_sensor_ticks = 0;
+        ui8_cadence_calc_ref_state = NO_PAS_REF;
+        ui8_pas_transitions = 0;
+        ui8_pas_state_old = 4;
+    }
+
+    // PAS1 and PAS2 edges merged in timestamp order
+    while ((ui8_pas1_fifo_read_index != ui8_pas1_write_index) || (ui8_pas2_fifo_read_index != ui8_pas2_write_index)) {
+        if (ui8_pas1_fifo_read_index != ui8_pas1_write_index) {
+            ui16_timestamp = ui16_pas1_fifo_timestamp[ui8_pas1_fifo_read_index & (PAS_FIFO_SIZE - 1)];
+            ui8_state = ui8_pas1_fifo_state[ui8_pas1_fifo_read_index & (PAS_FIFO_SIZE - 1)];
+            if (ui8_pas2_fifo_read_index != ui8_pas2_write_index) {
+                ui16_timestamp2 = ui16_pas2_fifo_timestamp[ui8_pas2_fifo_read_index & (PAS_FIFO_SIZE - 1)];
+                if ((int16_t)(ui16_timestamp2 - ui16_timestamp) < 0) {
+                    ui16_timestamp = ui16_timestamp2;
+                    ui8_state = ui8_pas2_fifo_state[ui8_pas2_fifo_read_index & (PAS_FIFO_SIZE - 1)];
+                    ui8_pas2_fifo_read_index++;
+                } else {
+                    ui8_pas1_fifo_read_index++;
+                }
+            } else {
+                ui8_pas1_fifo_read_index++;
+            }
+        } else {
+            ui16_timestamp = ui16_pas2_fifo_timestamp[ui8_pas2_fifo_read_index & (PAS_FIFO_SIZE - 1)];
+            ui8_state = ui8_pas2_fifo_state[ui8_pas2_fifo_read_index & (PAS_FIFO_SIZE - 1)];
+            ui8_pas2_fifo_read_index++;
+        }
+        // edge time in the 32 bits time base (edge less than 262ms old)
+        cadence_pas_transition(ui8_state, ui32_pas_timer - (uint16_t)(ui16_pas_timer_now - ui16_timestamp));
+    }
+}
 
+static void calc_cadence(void) 
+{
     // adjust cadence sensor ticks counter min depending on wheel speed
     uint8_t ui8_temp = map_ui8((uint8_t)(ui16_wheel_speed_x10 >> 2),
             10 /* 40 >> 2 */,
             100 /* 400 >> 2 */,
-            (CADENCE_SENSOR_CALC_COUNTER_MIN >> 4),
-            (CADENCE_SENSOR_TICKS_COUNTER_MIN_AT_SPEED >> 4));
+            (CADENCE_SENSOR_CALC_COUNTER_MIN >> 8),
+            (CADENCE_SENSOR_TICKS_COUNTER_MIN_AT_SPEED >> 8));
+
+    ui16_cadence_ticks_count_min_speed_adj = (uint16_t)ui8_temp << 8;
 
-    ui16_cadence_ticks_count_min_speed_adj = (uint16_t)ui8_temp << 4;
+    // edges not yet processed by the main loop, then time base update without edges
+    pas_edges_process();
+    pas_timer_update();
+
+    // no transition for more than the counter min: pedals stop detected
+    if (((ui32_pas_timer - ui32_pas_transition_time) >> CADENCE_SENSOR_TICKS_SHIFT) > ui16_cadence_sensor_ticks_counter_min) {
+        ui16_cadence_sensor_ticks = 0;
+        ui8_cadence_calc_ref_state = NO_PAS_REF;
+        ui8_pas_transitions = 0;
+    }
 
     // calculate cadence in RPM and avoid zero division
-    // !!!warning if PWM_CYCLES_SECOND > 21845
-    if (ui16_cadence_sensor_ticks_temp) {
-        ui8_pedal_cadence_RPM = (uint8_t)((PWM_CYCLES_SECOND * 3U) / ui16_cadence_sensor_ticks_temp);
+    if (ui16_cadence_sensor_ticks) {
+        ui8_pedal_cadence_RPM = (uint8_t)((CADENCE_SENSOR_TICKS_SECOND * 3U) / ui16_cadence_sensor_ticks);
     } else {
         ui8_pedal_cadence_RPM = 0;
     }
@@ -1260,13 +2416,14 @@ static void calc_cadence(void)
 
      NOTE: regarding the cadence calculation
 
-     Cadence is calculated by counting how many ticks there are between two LOW to HIGH transitions.
+     Cadence is calculated by the time of a PAS period (TIM3 timestamps of the PAS edges,
+     CADENCE_SENSOR_TICKS_SECOND ticks), updated at every forward transition.
 
      Formula for calculating the cadence in RPM:
 
-     (1) Cadence in RPM = (60 * PWM_CYCLES_SECOND) / CADENCE_SENSOR_NUMBER_MAGNETS) / ticks
+     (1) Cadence in RPM = (60 * CADENCE_SENSOR_TICKS_SECOND) / CADENCE_SENSOR_NUMBER_MAGNETS) / ticks
 
-     (2) Cadence in RPM = (PWM_CYCLES_SECOND * 3) / ticks
+     (2) Cadence in RPM = (CADENCE_SENSOR_TICKS_SECOND * 3) / ticks
 
      -------------------------------------------------------------------------------------------------*/
 }
@@ -1287,38 +2444,28 @@ static uint8_t ui8_TorqueMin = 0;
 static uint8_t ui8_TorqueMax = 0;
 
 
-// PWM IRQ set ui8_pas_new_transition when a new PAS signal transition is detected.
+static void torque_samples_reset(void) {
+    ui8_TSamplesNum = 0;
+    ui16_TSum = 0;
+    ui8_TSamplesPos = 0;
+    ui8_TorqueMin = 0;
+    ui8_TorqueMax = 0;
+    ui8_TorqueAVG = 0;
+}
+
+// Called by cadence_pas_transition() at every forward PAS transition (main loop).
 // 80 transtions/revolution (one every 4.5 deg)
 // @120 rmp: 160 transitions/sec 1 every 6,25 ms
-void new_torque_sample() {
+static void new_torque_sample(void) {
 
     uint16_t ui16_TorqueDeltaADC;
     uint8_t  ui8_TorqueDeltaADC;
 
-    if (ui8_pas_new_transition & 0x80) {
-    	// Pedal stop or backward rotation -> reset all
-        ui8_pas_new_transition = 0;
-        ui8_TSamplesNum = 0;
-        ui16_TSum = 0;
-        ui8_TSamplesPos = 0;
-        ui8_TorqueMin = 0;
-        ui8_TorqueMax = 0;
-        ui8_TorqueAVG = 0;
-        return;
-    }
-
-    ui8_pas_new_transition = 0;
-
     ui16_TorqueDeltaADC = ui16_adc_torque;
 
     if (ui16_adc_pedal_torque_offset > ui16_TorqueDeltaADC) {
     	// torque adc value less than 0 torque reference ADC -> reset all
-        ui8_TSamplesNum = 0;
-        ui16_TSum = 0;
-        ui8_TSamplesPos = 0;
-        ui8_TorqueMin = 0;
-        ui8_TorqueMax = 0;
-        ui8_TorqueAVG = 0;
+        torque_samples_reset();
         return;
     }
 
@@ -1374,9 +2521,6 @@ static void get_pedal_torque(void) {
         }
         ui16_adc_pedal_torque_delta = 0;
     } else {
-        if (ui8_pas_new_transition)
-            new_torque_sample();
-        
         // get adc pedal torque
         ui16_tmp = ui16_adc_torque;
 
@@ -1430,6 +2574,28 @@ void calc_motor_erps(void) {
 
 static void check_system()
 {
+    #define HARDWARE_OVERCURRENT_HOLD_OFF_THRESHOLD       33 // 33 * 30ms = 1 second
+
+    static uint8_t ui8_hardware_overcurrent_hold_off_counter;
+
+    // hardware over current: outputs already switched off by the TIM1 break input,
+    // keep the motor disabled and re-arm after the hold off time with duty cycle at 0
+    if (ui8_g_hardware_overcurrent) {
+        ui8_m_system_state |= ERROR_HARDWARE_OVERCURRENT;
+        if (ui8_motor_enabled) {
+            motor_disable_pwm();
+            ui8_motor_enabled = 0;
+        }
+        if (ui8_hardware_overcurrent_hold_off_counter < HARDWARE_OVERCURRENT_HOLD_OFF_THRESHOLD) {
+            ui8_hardware_overcurrent_hold_off_counter++;
+        } else if (!ui8_g_duty_cycle && motor_break_recovery()) {
+            ui8_hardware_overcurrent_hold_off_counter = 0;
+            ui8_m_system_state &= ~ERROR_HARDWARE_OVERCURRENT;
+        }
+    }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
     #define CHECK_SPEED_SENSOR_COUNTER_THRESHOLD          250 // 250 * 30ms = 7.5 seconds
     #define MOTOR_ERPS_SPEED_THRESHOLD	                  180
 	static uint8_t ui8_check_speed_sensor_counter;
@@ -1549,10 +2715,15 @@ static void check_system()
              if (ui8_m_system_state & ERROR_MOTOR_BLOCKED) {
                 ui8_m_system_state &= ~ERROR_MOTOR_BLOCKED;
             }
+            ui8_g_motor_stalled = 0;
 
             // reset the counter that clears the motor blocked error
             ui8_motor_blocked_reset_counter = 0;
         }
+    } else if (ui8_g_motor_stalled) {
+        // stall already detected by the PWM interrupt (duty cycle cut)
+        ui8_m_system_state |= ERROR_MOTOR_BLOCKED;
+        ui8_motor_blocked_counter = 0;
     } else {
         // if battery current is over the current threshold and the motor ERPS is below threshold start setting motor blocked error code
         if ((ui8_adc_battery_current_filtered > MOTOR_BLOCKED_BATTERY_CURRENT_THRESHOLD_ADC_STEPS)
@@ -1630,14 +2801,34 @@ void ebike_control_lights(void)
 // from v.1.1.0 ********************************************************************************************************
 // This is the interrupt that happens when UART2 receives data.
 
-void UART2_RX_IRQHandler(void) __interrupt(UART2_RX_IRQHANDLER)
+// Naked routine: only the registers saved by the interrupt hardware are used
+void UART2_RX_IRQHandler(void) __interrupt(UART2_RX_IRQHANDLER) __naked
 {
+    /*
     if (UART2->SR & 0x20) {
         //Write the recieved data to the ringbuffer at the write index position, move write index forward.
         ui8_rx_ringbuffer[(uint8_t)(ui8_rx_ringbuffer_write_index++)] = ((uint8_t)UART2->DR);//UART2_ReceiveData8(); save a few cycles...
         // If write index hits the read index - move read index forward. Effectively overwrites the oldest data in the buffer.
         if (((uint8_t)ui8_rx_ringbuffer_write_index)==(uint8_t)(ui8_rx_ringbuffer_read_index)) ui8_rx_ringbuffer_read_index++;
     }
+    */
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        btjf 0x5240, #5, 00001$             // if (UART2->SR & 0x20) (RXNE)
+        clrw x
+        ld  a, _ui8_rx_ringbuffer_write_index+0
+        ld  xl, a
+        ld  a, 0x5241                       // UART2->DR (clears RXNE)
+        ld  (_ui8_rx_ringbuffer+0, x), a
+        inc _ui8_rx_ringbuffer_write_index+0
+        ld  a, _ui8_rx_ringbuffer_write_index+0
+        cp  a, _ui8_rx_ringbuffer_read_index+0
+        jrne 00001$
+        inc _ui8_rx_ringbuffer_read_index+0
+    00001$:
+        iret
+    __endasm;
+    #endif
 }
 
 
@@ -1767,6 +2958,7 @@ static void communications_process_packages(uint8_t ui8_frame_type)
 {
 	uint8_t ui8_temp;
 	uint16_t ui16_temp;
+	uint16_t ui16_irq_load_period;
 	uint8_t ui8_len = 3; // 3 bytes: 1 type of frame + 2 CRC bytes
 
 	// start up byte
@@ -1938,7 +3130,6 @@ static void communications_process_packages(uint8_t ui8_frame_type)
 
 		// wheel perimeter
 		m_configuration_variables.ui16_wheel_perimeter = (((uint16_t) ui8_rx_buffer[6]) << 8) + ((uint16_t) ui8_rx_buffer[5]);
-        ui16_wheel_calc_const = (uint16_t)((((uint32_t)m_configuration_variables.ui16_wheel_perimeter) * PWM_CYCLES_SECOND / 1000 * 36U) >> 5);
 
 		// battery max current
 		ui8_battery_current_max = ui8_rx_buffer[7];
@@ -1962,6 +3153,7 @@ static void communications_process_packages(uint8_t ui8_frame_type)
 		{
 			// 48 V motor
 			m_configuration_variables.ui8_foc_angle_multiplicator = FOC_MULTIPLICATOR_48V;
+			ui16_motor_launch_duty_k = MOTOR_LAUNCH_DUTY_K_48V;
 			i16_cruise_pid_kp = 12;
 			i16_cruise_pid_ki = 1;
 		}
@@ -1969,10 +3161,16 @@ static void communications_process_packages(uint8_t ui8_frame_type)
 		{
 			// 36 V motor
 			m_configuration_variables.ui8_foc_angle_multiplicator = FOC_MULTIPLICATOR_36V;
+			ui16_motor_launch_duty_k = MOTOR_LAUNCH_DUTY_K_36V;
 			i16_cruise_pid_kp = 14;
 			i16_cruise_pid_ki = 0.7;
 		}
 
+		// value found by the FOC angle multiplicator calibration
+		if (ui8_foc_angle_multiplicator_calibrated) {
+			m_configuration_variables.ui8_foc_angle_multiplicator = ui8_foc_angle_multiplicator_calibrated;
+		}
+
 		// startup boost
 		ui8_startup_boost_factor_array[0] = ui8_rx_buffer[9];
 		ui8_startup_boost_cadence_step = ui8_rx_buffer[10];
@@ -2073,7 +3271,20 @@ static void communications_process_packages(uint8_t ui8_frame_type)
         }
         for (ui8_temp = 0; ui8_temp < 6; ui8_temp++) {
             ui8_hall_ref_angles[ui8_temp] = ui8_hall_ref_angles_config[ui8_temp];
+            ui8_hall_counter_offsets_config[ui8_temp] = ui8_hall_counter_offsets[ui8_temp];
         }
+        // wheel speed sensor pulses per wheel revolution (optional, 1 if not sent)
+        ui8_temp = (ui8_rx_buffer[1] > 36) ? ui8_rx_buffer[36] : 1;
+        if (ui8_temp == 0)
+            ui8_temp = 1;
+        else if (ui8_temp > WHEEL_SPEED_SENSOR_PULSES_MAX)
+            ui8_temp = WHEEL_SPEED_SENSOR_PULSES_MAX;
+        wheel_speed_sensor_set_pulses(ui8_temp);
+        // speed from the period of one pulse: perimeter / pulses per revolution
+        ui32_wheel_calc_const = ((uint32_t)m_configuration_variables.ui16_wheel_perimeter) * WHEEL_SPEED_SENSOR_TICKS_SECOND / 100 * 36U / 10 / ui8_temp;
+
+        hall_counter_offsets_adapt_reset();
+        motor_parameters_estimate_reset();
         ui8_configurations_changed = 1;
 
         // reset ringbuffer count - start with new packets
@@ -2100,6 +3311,48 @@ static void communications_process_packages(uint8_t ui8_frame_type)
 		break;
 
       case COMM_FRAME_TYPE_HALL_CALBRATION:
+        if ((ui8_rx_buffer[3] >= 3) && (ui8_rx_buffer[3] <= 5)) {
+            // automatic calibration, start a new run if not already running or finished
+            if ((ui8_rx_buffer[3] == 3) && (ui8_riding_mode != HALL_CALIBRATION_MODE)) {
+                ui8_calibration_state = CALIBRATION_STATE_RUNNING;
+                ui8_hall_calibration_point = 0;
+                ui8_hall_calibration_counter = 0;
+                ui8_hall_calibration_timeout = 0;
+                ui8_riding_mode = HALL_CALIBRATION_MODE;
+            } else if ((ui8_rx_buffer[3] == 5) && (ui8_riding_mode != FOC_CALIBRATION_MODE)) {
+                ui8_calibration_state = CALIBRATION_STATE_RUNNING;
+                ui8_foc_calibration_point = 0;
+                ui8_angle_sweep_step = 0;
+                ui8_angle_sweep_counter = 0;
+                ui8_angle_sweep_timeout = 0;
+                ui8_riding_mode = FOC_CALIBRATION_MODE;
+            } else if ((ui8_rx_buffer[3] == 4) && (ui8_riding_mode != ROTOR_OFFSET_CALIBRATION_MODE)) {
+                // ui8_rx_buffer[4] is the ERPS set-point, 0 for default
+                ui8_calibration_erps_target = ui8_rx_buffer[4] ? ui8_rx_buffer[4] : ROTOR_OFFSET_CALIBRATION_ERPS;
+                ui8_calibration_state = CALIBRATION_STATE_RUNNING;
+                ui8_angle_sweep_step = 0;
+                ui8_angle_sweep_counter = 0;
+                ui8_angle_sweep_timeout = 0;
+                i8_rotor_offset_calibration_result = 0;
+                ui8_riding_mode = ROTOR_OFFSET_CALIBRATION_MODE;
+            }
+
+            // send data back
+            ui8_tx_buffer[3] = ui8_calibration_state;
+            ui8_tx_buffer[4] = (ui8_riding_mode == HALL_CALIBRATION_MODE) ? ui8_hall_calibration_point : ui8_angle_sweep_step;
+            for (ui8_temp = 0; ui8_temp < 6; ui8_temp++) {
+                ui8_tx_buffer[5 + ui8_temp] = ui8_hall_ref_angles[ui8_temp];
+                ui8_tx_buffer[11 + ui8_temp] = ui8_hall_counter_offsets[ui8_temp];
+            }
+            ui8_tx_buffer[17] = (uint8_t)i8_rotor_offset_calibration_result;
+            ui8_tx_buffer[18] = ui8_foc_calibration_point;
+            ui8_tx_buffer[19] = m_configuration_variables.ui8_foc_angle_multiplicator;
+
+            ui8_len += 17;
+            break;
+        }
+
+        ui8_calibration_state = CALIBRATION_STATE_IDLE;
         if (ui8_rx_buffer[3] == 1) {
             ui8_riding_mode_parameter = ui8_rx_buffer[4];
             ui8_riding_mode = PWM_CALIBRATION_ASSIST_MODE;
@@ -2140,6 +3393,75 @@ static void communications_process_packages(uint8_t ui8_frame_type)
         ui8_len += 14;
         break;
 
+      case COMM_FRAME_TYPE_DIAGNOSTIC:
+        // ui8_rx_buffer[3] selects the diagnostic page
+        ui8_tx_buffer[3] = ui8_rx_buffer[3];
+        switch (ui8_rx_buffer[3]) {
+          // page 0: Hall counter offsets online adaptation
+          case 0:
+            ui8_tx_buffer[4] = ui8_hall_adapt_estimate_valid;
+            for (ui8_temp = 0; ui8_temp < 6; ui8_temp++) {
+                ui8_tx_buffer[5 + ui8_temp] = ui8_hall_calibration_offsets[ui8_temp];
+                ui8_tx_buffer[11 + ui8_temp] = ui8_hall_counter_offsets[ui8_temp];
+            }
+            // samples in each bin, saturated
+            ui8_tx_buffer[17] = (ui16_hall_adapt_samples[0] > 255) ? 255 : (uint8_t) ui16_hall_adapt_samples[0];
+            ui8_tx_buffer[18] = (ui16_hall_adapt_samples[1] > 255) ? 255 : (uint8_t) ui16_hall_adapt_samples[1];
+            ui8_len += 16;
+            break;
+
+          // page 1: protection events
+          case 1:
+            ui8_tx_buffer[4] = ui8_hardware_overcurrent_counter;
+            ui8_tx_buffer[5] = ui8_brake_fast_stop_counter;
+            // PWM interrupt timing since the last report (TIM1 counts)
+            disableInterrupts();
+            ui8_tx_buffer[6] = (uint8_t) (ui16_pwm_irq_overrun_counter & 0xff);
+            ui8_tx_buffer[7] = (uint8_t) (ui16_pwm_irq_overrun_counter >> 8);
+            ui8_tx_buffer[8] = (uint8_t) (ui16_pwm_irq_up_time_max & 0xff);
+            ui8_tx_buffer[9] = (uint8_t) (ui16_pwm_irq_up_time_max >> 8);
+            ui8_tx_buffer[10] = (uint8_t) (ui16_pwm_irq_down_time_max & 0xff);
+            ui8_tx_buffer[11] = (uint8_t) (ui16_pwm_irq_down_time_max >> 8);
+            ui8_tx_buffer[12] = ui8_pwm_irq_sim_time_max;
+            ui8_tx_buffer[13] = ui8_battery_current_peak_counter;
+            // PWM interrupt CPU load, 0.1%
+            ui16_temp = ui16_pwm_irq_load_time;
+            ui16_irq_load_period = ui16_pwm_irq_load_period;
+            ui16_pwm_irq_overrun_counter = 0;
+            ui16_pwm_irq_up_time_max = 0;
+            ui16_pwm_irq_down_time_max = 0;
+            ui8_pwm_irq_sim_time_max = 0;
+            enableInterrupts();
+            if (ui16_irq_load_period) {
+                ui16_temp = (uint16_t)(((uint32_t)ui16_temp * 1000U) / ui16_irq_load_period);
+            }
+            ui8_tx_buffer[14] = (uint8_t) (ui16_temp & 0xff);
+            ui8_tx_buffer[15] = (uint8_t) (ui16_temp >> 8);
+            ui8_len += 13;
+            break;
+
+          // page 2: motor parameters online estimation
+          case 2:
+            ui8_tx_buffer[4] = ui8_motor_estimate_valid;
+            ui8_tx_buffer[5] = (uint8_t) (ui16_motor_k_estimate & 0xff);
+            ui8_tx_buffer[6] = (uint8_t) (ui16_motor_k_estimate >> 8);
+            // phase resistance, mohm
+            ui16_temp = (uint16_t)(((uint32_t)ui8_motor_r_estimate * MOTOR_ESTIMATE_R_MOHM_X256) >> 8);
+            ui8_tx_buffer[7] = (uint8_t) (ui16_temp & 0xff);
+            ui8_tx_buffer[8] = (uint8_t) (ui16_temp >> 8);
+            ui8_tx_buffer[9] = ui8_motor_winding_temperature_rise;
+            // samples in each bin, saturated
+            ui8_tx_buffer[10] = (ui16_motor_estimate_samples[0] > 255) ? 255 : (uint8_t) ui16_motor_estimate_samples[0];
+            ui8_tx_buffer[11] = (ui16_motor_estimate_samples[1] > 255) ? 255 : (uint8_t) ui16_motor_estimate_samples[1];
+            ui8_len += 9;
+            break;
+
+          default:
+            ui8_len += 1;
+            break;
+        }
+        break;
+
       default:
 		break;
 	}
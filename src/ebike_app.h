@@ -12,8 +12,6 @@
 #include <stdint.h>
 #include "main.h"
 
-// cadence sensor
-extern uint16_t ui16_cadence_ticks_count_min_speed_adj;
 extern volatile uint8_t ui8_brake_fast_stop;
 extern volatile uint8_t ui8_adc_motor_phase_current_max;
 
@@ -34,6 +32,6 @@ typedef struct _configuration_variables {
 } struct_configuration_variables;
 
 void ebike_app_controller(void);
-void new_torque_sample(void);
+void pas_edges_process(void);
 
 #endif /* _EBIKE_APP_H_ */
@@ -52,6 +52,8 @@ int main(void);
 
 // PWM cycle interrupt (called every 64us)
 void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER);
+// TIM1 break interrupt (hardware over current on PD0 / TIM1_BKIN)
+void TIM1_BRK_IRQHandler(void) __interrupt(TIM1_OVF_IRQHANDLER);
 // UART Receive interrupt
 void UART2_RX_IRQHandler(void) __interrupt(UART2_RX_IRQHANDLER);
 // UART TX interrupt
@@ -62,6 +64,12 @@ void TIM4_IRQHandler(void) __interrupt(TIM4_OVF_IRQHANDLER);
 void HALL_SENSOR_A_PORT_IRQHandler(void) __interrupt(EXTI_HALL_A_IRQ);
 void HALL_SENSOR_B_PORT_IRQHandler(void) __interrupt(EXTI_HALL_B_IRQ);
 void HALL_SENSOR_C_PORT_IRQHandler(void) __interrupt(EXTI_HALL_C_IRQ);
+// PAS2 signal interrupt (PAS1: Hall sensor A port interrupt)
+void PAS2_TLI_IRQHandler(void) __interrupt(EXTI_PAS2_IRQ);
+// Wheel speed sensor signal interrupt
+void WHEEL_SPEED_SENSOR_PORT_IRQHandler(void) __interrupt(EXTI_WHEEL_SPEED_SENSOR_IRQ);
+// TIM3 Overflow interrupt (called every 262ms)
+void TIM3_OVF_IRQHandler(void) __interrupt(TIM3_OVF_IRQHANDLER);
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -93,9 +101,14 @@ int main(void) {
 
     while (1) {
 
-        if (ui8_pas_new_transition) {
-            new_torque_sample();
+        // PAS transitions: cadence and torque samples
+        pas_edges_process();
+
+        #ifdef SINGLE_SHUNT_FOC
+        if (ui8_shunt_new_sample) {
+            motor_foc_current_loop();
         }
+        #endif
 
         // ebike controller - run every 30ms (TIM4 counter @ 2ms)
         if (ui8_ebike_controller_counter >= 15) {
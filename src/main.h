@@ -12,6 +12,10 @@
 //#define DEBUG_UART
 //#define PWM_TIME_DEBUG
 //#define MAIN_TIME_DEBUG
+//#define SINGLE_SHUNT_FOC
+//#define PWM_FREQUENCY_SELECT
+//#define PWM_SINGLE_IRQ
+//#define MOTOR_WINDING_TEMPERATURE_LIMIT
 
 #define FW_VERSION 201CV15
 
@@ -62,17 +66,26 @@
 #define THROTTLE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT        (uint8_t)(PWM_CYCLES_SECOND/195)     // 80 at 15.625KHz
 #define THROTTLE_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_MIN            (uint8_t)(PWM_CYCLES_SECOND/390)     // 40 at 15.625KHz
 
+// controller targets slew: PWM cycles between two ebike_control_motor() runs (30ms)
+#define CONTROLLER_TARGET_SLEW_PWM_CYCLES                       (uint16_t)((uint32_t)PWM_CYCLES_SECOND*3U/100U) // 540
+
 #define MOTOR_OVER_SPEED_ERPS                                   ((PWM_CYCLES_SECOND/29) < 650 ?  (PWM_CYCLES_SECOND/29) : 650) // motor max speed | 29 points for the sinewave at max speed (less than PWM_CYCLES_SECOND/29)
 
-// cadence
-#define CADENCE_SENSOR_CALC_COUNTER_MIN                         (uint16_t)((uint32_t)PWM_CYCLES_SECOND*100U/446U)  // 3500 at 15.625KHz - adjust for integer overflows
-#define CADENCE_SENSOR_TICKS_COUNTER_MIN_AT_SPEED               (uint16_t)((uint32_t)PWM_CYCLES_SECOND*10U/558U)   // 280 at 15.625KHz - adjusted for integer overflows
-#define CADENCE_TICKS_STARTUP                                   (uint16_t)((uint32_t)PWM_CYCLES_SECOND*10U/25U)  // ui16_cadence_sensor_ticks value for startup. About 7-8 RPM (6250 at 15.625KHz)
-#define CADENCE_SENSOR_STANDARD_MODE_SCHMITT_TRIGGER_THRESHOLD  (uint16_t)((uint32_t)PWM_CYCLES_SECOND*10U/446U)   // software based Schmitt trigger to stop motor jitter when at resolution limits (350 at 15.625KHz)
+// cadence: PAS edges timestamped by the Hall counter (TIM3, 4us), periods in 8us ticks
+#define CADENCE_SENSOR_TICKS_SHIFT                              1   // 8us ticks
+#define CADENCE_SENSOR_TICKS_SECOND                             (HALL_COUNTER_FREQ >> CADENCE_SENSOR_TICKS_SHIFT) // 125000
+#define CADENCE_SENSOR_CALC_COUNTER_MIN                         (uint16_t)((uint32_t)CADENCE_SENSOR_TICKS_SECOND*100U/446U)  // 28026 (224ms) - adjust for integer overflows
+#define CADENCE_SENSOR_TICKS_COUNTER_MIN_AT_SPEED               (uint16_t)((uint32_t)CADENCE_SENSOR_TICKS_SECOND*10U/558U)   // 2240 (18ms) - adjusted for integer overflows
+#define CADENCE_SENSOR_STANDARD_MODE_SCHMITT_TRIGGER_THRESHOLD  (uint16_t)((uint32_t)CADENCE_SENSOR_TICKS_SECOND*10U/446U)   // software based Schmitt trigger to stop motor jitter when at resolution limits (2802)
+#define PAS_FIFO_SIZE                                           8   // PAS edges for each sensor (power of 2)
 
-// Wheel speed sensor
-#define WHEEL_SPEED_SENSOR_TICKS_COUNTER_MAX                    (uint16_t)((uint32_t)PWM_CYCLES_SECOND*10U/1157U)   // (135 at 15,625KHz) something like 200 m/h with a 6'' wheel
-#define WHEEL_SPEED_SENSOR_TICKS_COUNTER_MIN                    (uint16_t)((uint32_t)PWM_CYCLES_SECOND*1000U/477U) // 32767@15625KHz could be a bigger number but will make for a slow detection of stopped wheel speed
+// Wheel speed sensor: rising edge interrupt, period from the Hall counter (TIM3, 4us) timestamps
+#define WHEEL_SPEED_SENSOR_TICKS_SHIFT                          3   // 32us ticks
+#define WHEEL_SPEED_SENSOR_TICKS_SECOND                         (HALL_COUNTER_FREQ >> WHEEL_SPEED_SENSOR_TICKS_SHIFT) // 31250
+#define WHEEL_SPEED_SENSOR_TICKS_COUNTER_MAX                    (uint16_t)((uint32_t)WHEEL_SPEED_SENSOR_TICKS_SECOND*10U/1157U)   // 270 (8.6ms) something like 200 m/h with a 6'' wheel
+#define WHEEL_SPEED_SENSOR_TICKS_COUNTER_MIN                    (uint16_t)((uint32_t)WHEEL_SPEED_SENSOR_TICKS_SECOND*1000U/477U) // 65513 (2.1s) could be a bigger number but will make for a slow detection of stopped wheel speed
+#define WHEEL_SPEED_SENSOR_WRAPS_MAX                            8   // TIM3 wraps (262ms) without edges: wheel stopped
+#define WHEEL_SPEED_SENSOR_PULSES_MAX                           16  // magnets per wheel revolution (limits above divided by this number)
 
 
 #define MIDDLE_SVM_TABLE                                        110
@@ -81,6 +94,147 @@
 #define PWM_DUTY_CYCLE_MAX                                      254
 #define PWM_DUTY_CYCLE_STARTUP                                  30    // Initial PWM Duty Cycle at motor startup
 
+/*---------------------------------------------------------
+ NOTE: regarding PWM frequency selection
+
+ With PWM_FREQUENCY_SELECT the PWM period is switched at
+ runtime between the entries of a RAM table (see motor.c):
+ a higher frequency at low speed for a smoother current and
+ a lower frequency at high load for lower switching losses.
+ The phase compare center, duty cycle max and over speed
+ limit are switched by the PWM down interrupt, before the
+ compare values are calculated; the up interrupt sets TIM1
+ ARR just after loading them (CCR4 is preloaded).
+ The duty cycle (ui8_g_duty_cycle, targets and the app) is
+ always in MIDDLE_PWM_COUNTER units, the same phase voltage
+ at any period: the down interrupt scales it to the current
+ period for the compare values. The duty cycle max of the
+ low frequency is lower (about 223): keep
+ PWM_FREQUENCY_LOW_DUTY_CYCLE_MAX below it.
+ Ramps stay in PWM_CYCLES_SECOND units (18 kHz): the ramp
+ inverse steps are scaled by ebike_app.
+ The PWM compare values are computed in 8 bits: middle
+ counter + amplitude (max 110) must be <= 255 and the
+ amplitude <= middle counter (duty cycle max).
+ ---------------------------------------------------------*/
+#define PWM_FREQUENCY_HIGH                      0   // 20 kHz, low speed
+#define PWM_FREQUENCY_DEFAULT                   1   // 18 kHz
+#define PWM_FREQUENCY_LOW                       2   // 16 kHz, high load
+#define PWM_FREQUENCY_NUMBER                    3
+#define PWM_FREQUENCY_HIGH_COUNTER_MAX          400
+#define PWM_FREQUENCY_LOW_COUNTER_MAX           500
+#define PWM_FREQUENCY_LOW_SPEED_ERPS            60  // high frequency below this motor speed
+#define PWM_FREQUENCY_ERPS_HYSTERESIS           10
+#define PWM_FREQUENCY_HIGH_LOAD_ADC_CURRENT     75  // low frequency above this battery current (12 amps)
+#define PWM_FREQUENCY_CURRENT_HYSTERESIS        12  // 2 amps
+#define PWM_FREQUENCY_LOW_DUTY_CYCLE_MAX        200 // low frequency limits the max phase voltage
+#define PWM_FREQUENCY_HOLD_OFF                  10  // min 300ms between two switches (ebike_app_controller cycles)
+
+#ifdef PWM_FREQUENCY_SELECT
+#ifdef SINGLE_SHUNT_FOC
+#error "PWM_FREQUENCY_SELECT and SINGLE_SHUNT_FOC can not be used together"
+#endif
+#endif
+
+/*---------------------------------------------------------
+ NOTE: regarding single PWM interrupt
+
+ By default TIM1 is center aligned mode 3 and the OC4
+ interrupt (middle of the counter) fires twice per PWM
+ period: the down interrupt reads the Hall state and
+ calculates the rotor angle and the phase compare values,
+ the up interrupt writes them and runs ADC, protections and
+ duty cycle controller.
+ With PWM_SINGLE_IRQ TIM1 is center aligned mode 1 and only
+ the down interrupt fires: the same work is done in one
+ interrupt, the entry/exit overhead is paid once per period
+ but the interrupt busy-waits the end of the ADC scan.
+ It is not a CPU time saving by itself: compare the CPU
+ load of the two modes before using it.
+ Timing changes:
+ - the compare values are written about half a PWM period
+   earlier (same interrupt that calculates them)
+ - the ADC scan is triggered at the OC4 match, the
+   interrupt waits its end (21us from the match, minus the
+   angle calculation time) before reading the values
+ - the duty cycle is updated half a period earlier and is
+   used by the angle calculation of the next period, as
+   before: same control latency of one period
+ - the worst case of the single interrupt is the sum of the
+   two, the Hall interrupt latency (sim windows) is the same.
+ The CPU load of the PWM interrupt of the last 256 periods
+ is measured in both modes (diagnostic page 1).
+ PWM_FREQUENCY_SELECT sets the new period from the up
+ interrupt, while counting up: not available in this mode.
+ ---------------------------------------------------------*/
+#ifdef PWM_SINGLE_IRQ
+#ifdef SINGLE_SHUNT_FOC
+#error "PWM_SINGLE_IRQ and SINGLE_SHUNT_FOC can not be used together"
+#endif
+#ifdef PWM_FREQUENCY_SELECT
+#error "PWM_SINGLE_IRQ and PWM_FREQUENCY_SELECT can not be used together"
+#endif
+#endif
+
+/*---------------------------------------------------------
+ NOTE: regarding motor launch
+
+ At motor enable the initial duty cycle matches the motor
+ back EMF at the measured speed and battery voltage, plus
+ PWM_DUTY_CYCLE_STARTUP:
+ duty = ERPS * MOTOR_LAUNCH_DUTY_K / ADC battery voltage
+ with K = 255 * Ke[V/ERPS] / BATTERY_VOLTAGE_PER_10_BIT_ADC_STEP
+ (about 533 ERPS no load at nominal voltage for both motors)
+ ---------------------------------------------------------*/
+#define MOTOR_LAUNCH_DUTY_K_36V                                 198   // 255 * (36V / 533 ERPS) / 0.087V
+#define MOTOR_LAUNCH_DUTY_K_48V                                 264   // 255 * (48V / 533 ERPS) / 0.087V
+#define MOTOR_LAUNCH_ERPS_MAX                                   240   // launch only below this speed
+
+/*---------------------------------------------------------
+ NOTE: regarding motor parameters online estimation
+
+ At steady speed the motor voltage and phase current are
+ averaged in two phase current bins:
+ duty * ADC battery voltage = K * ERPS + R * phase current
+ with phase current = (ADC battery current << 8) / duty.
+ K is the back EMF constant in the MOTOR_LAUNCH_DUTY_K units
+ and R the phase resistance in
+ 256 * BATTERY_CURRENT_STEP / BATTERY_VOLTAGE_STEP units
+ (about 2.1 mohm). The two averaged points are solved for K
+ and R, the estimates are filtered and replace the fixed
+ launch K while inside MOTOR_ESTIMATE_K_RANGE_PERCENT of it.
+ The winding temperature rise is estimated from the R
+ estimate filtered again (MOTOR_WINDING_R_FILTER_SHIFT,
+ steps over MOTOR_WINDING_R_STEP_MAX discarded) over its
+ lowest value since power on (copper 0.39%/degC: 1 degC
+ every R/255, 1 R unit is about 5 degC). Rises over
+ MOTOR_WINDING_TEMPERATURE_RISE_MAX are implausible and
+ discarded, decreases have MOTOR_WINDING_TEMPERATURE_HYSTERESIS.
+ The rise is reported in the diagnostic page 2.
+ With MOTOR_WINDING_TEMPERATURE_LIMIT and without a
+ temperature sensor, the rise added to
+ MOTOR_ESTIMATE_TEMPERATURE_REFERENCE (assumed winding
+ temperature at power on: a warm motor at power on is seen
+ colder) limits the current with the motor temperature
+ limits of the display.
+ ---------------------------------------------------------*/
+#define MOTOR_ESTIMATE_ERPS_MIN                                 80
+#define MOTOR_ESTIMATE_ERPS_DELTA_MAX                           2     // max ERPS change between two 30ms loops for steady speed
+#define MOTOR_ESTIMATE_DUTY_CYCLE_DELTA_MAX                     2     // max duty cycle change between two 30ms loops
+#define MOTOR_ESTIMATE_PHASE_CURRENT_BIN                        40    // low bin below 6.4A, high bin from 6.4A
+#define MOTOR_ESTIMATE_FILTER_SHIFT                             5     // exponential average time constant: 32 samples
+#define MOTOR_ESTIMATE_SAMPLES_MIN                              64    // samples required in each bin before estimating
+#define MOTOR_ESTIMATE_DET_MIN                                  1000  // min determinant of the two points (ERPS * phase current)
+#define MOTOR_ESTIMATE_UPDATE_COUNT                             100   // 100 * 30ms = 3 seconds between estimates
+#define MOTOR_ESTIMATE_K_RANGE_PERCENT                          25
+#define MOTOR_ESTIMATE_R_MAX                                    255   // about 0.54 ohm
+#define MOTOR_ESTIMATE_R_MOHM_X256                              544   // 1000 * 256 * 0.087V / (256 * 0.16A)
+#define MOTOR_ESTIMATE_TEMPERATURE_REFERENCE                    25    // degC
+#define MOTOR_WINDING_R_FILTER_SHIFT                            3     // 8 estimates (24 seconds)
+#define MOTOR_WINDING_R_STEP_MAX                                4     // max R estimate change from the filtered value
+#define MOTOR_WINDING_TEMPERATURE_RISE_MAX                      120   // degC
+#define MOTOR_WINDING_TEMPERATURE_HYSTERESIS                    10    // degC
+
 // ----------------------------------------------------------------------------------------------------------------
 // ----------------------------------------------------------------------------------------------------------------
 
@@ -112,8 +266,87 @@ HALL_COUNTER_OFFSET_UP:    29 -> 44
 #define HALL_COUNTER_OFFSET_UP                  (HALL_COUNTER_OFFSET_DOWN + 21)
 #define FW_HALL_COUNTER_OFFSET_MAX              6 // 6*4=24us max time offset
 
+/*---------------------------------------------------------
+ NOTE: regarding automatic Hall calibration
+
+ The motor is run without load at HALL_CALIBRATION_POINTS
+ ERPS set-points. At each one the six Hall sector counts are
+ averaged and a linear regression (sector count vs. total
+ electrical revolution count) gives the sector width (slope)
+ and the Hall edge delays (intercept), same as the
+ HallCalibrationJava tool.
+ ---------------------------------------------------------*/
+#define HALL_CALIBRATION_POINTS                 4
+#define HALL_CALIBRATION_ERPS_MIN               60  // first set-point (4166 Hall counts per electrical revolution)
+#define HALL_CALIBRATION_ERPS_STEP              40  // 60, 100, 140, 180 ERPS
+#define HALL_CALIBRATION_ERPS_TOLERANCE         3
+#define HALL_CALIBRATION_SETTLE_COUNT           33  // 33 * 30ms = 1 second within tolerance
+#define HALL_CALIBRATION_AVERAGE_COUNT          32  // 32 * 30ms = 0.96 seconds averaging
+#define HALL_CALIBRATION_TIMEOUT                250 // 250 * 30ms = 7.5 seconds to reach a set-point
+#define HALL_CALIBRATION_SLOPE_MIN_X4096        512 // 45 degrees sector width
+#define HALL_CALIBRATION_SLOPE_MAX_X4096        853 // 75 degrees sector width
+
+/*---------------------------------------------------------
+ NOTE: regarding automatic rotor offset calibration
+
+ Replaces the manual tuning of MOTOR_ROTOR_OFFSET_ANGLE:
+ with the wheel in the air the motor is held at a fixed
+ ERPS while a global offset is added to the Hall reference
+ angles. The offset of minimum battery current (parabola
+ fit) is added to the configured angles.
+ ---------------------------------------------------------*/
+#define ANGLE_SWEEP_POINTS_MAX                  9
+#define ANGLE_SWEEP_AVERAGE_COUNT               64  // 64 * 30ms = 1.9 seconds averaging
+#define ROTOR_OFFSET_CALIBRATION_ERPS           150
+#define ROTOR_OFFSET_SWEEP_START                -8  // -8 * 1.4 = -11 degrees
+#define ROTOR_OFFSET_SWEEP_STEP                 2
+#define ROTOR_OFFSET_SWEEP_POINTS               9   // -8 to +8
+
+// FOC angle multiplicator calibration: angle sweep at every ERPS load point
+#define FOC_CALIBRATION_POINTS                  3
+#define FOC_CALIBRATION_ERPS_MIN                100
+#define FOC_CALIBRATION_ERPS_STEP               60  // 100, 160, 220 ERPS
+#define FOC_CALIBRATION_SWEEP_START             0
+#define FOC_CALIBRATION_SWEEP_STEP              2
+#define FOC_CALIBRATION_SWEEP_POINTS            7   // 0 to +12
+
+/*---------------------------------------------------------
+ NOTE: regarding Hall counter offsets online adaptation
+
+ While riding at steady speed the Hall sector counts are
+ exponentially averaged in two ERPS bins. Periodically the
+ two averaged points are fed to the Hall calibration solver
+ and every counter offset is moved by one step toward the
+ estimate, never further than HALL_COUNTER_OFFSET_ADAPT_MAX
+ from the configured value.
+ ---------------------------------------------------------*/
+#define HALL_COUNTER_OFFSET_ADAPT_MAX           4   // 4*4=16us max deviation from configured offsets
+#define HALL_ADAPT_ERPS_MIN                     50
+#define HALL_ADAPT_ERPS_BIN                     110 // low bin 50-109 ERPS, high bin from 110 ERPS
+#define HALL_ADAPT_ERPS_DELTA_MAX               2   // max ERPS change between two 30ms loops for steady speed
+#define HALL_ADAPT_FILTER_SHIFT                 6   // exponential average time constant: 64 samples
+#define HALL_ADAPT_SAMPLES_MIN                  128 // samples required in each bin before adapting
+#define HALL_ADAPT_X_SPREAD_MIN                 400 // min difference of the bins average Hall counts per revolution
+#define HALL_ADAPT_UPDATE_COUNT                 333 // 333 * 30ms = 10 seconds between offset steps
 
+
+/*---------------------------------------------------------
+ NOTE: regarding low speed interpolation
+
+ Below MOTOR_ROTOR_INTERPOLATION_MIN_ERPS the rotor angle is
+ interpolated from the last Hall sector interval, starting
+ from the Hall transition and clamped to
+ LOW_SPEED_SECTOR_ANGLE_MAX so the voltage vector never
+ passes the next sector. The Hall counter (TIM3, 4us tick)
+ wraps every 262ms: wraps are counted by the PWM interrupt,
+ up to LOW_SPEED_TIMER_WRAPS_MAX, then the rotor is
+ considered stopped and the voltage vector is placed in the
+ middle of the Hall sector (HALL_SECTOR_HALF_ANGLE).
+ ---------------------------------------------------------*/
 #define MOTOR_ROTOR_INTERPOLATION_MIN_ERPS      15
+#define HALL_SECTOR_HALF_ANGLE                  21 // 30 degrees, block commutation voltage vector in the middle of the Hall sector
+#define LOW_SPEED_SECTOR_ANGLE_MAX              42 // 59 degrees
+#define LOW_SPEED_TIMER_WRAPS_MAX               3  // sector intervals up to 4 * 262ms
 
 // Torque sensor values
 #define ADC_TORQUE_SENSOR_CALIBRATION_OFFSET    (uint8_t)6
@@ -138,6 +371,19 @@ HALL_COUNTER_OFFSET_UP:    29 -> 44
 #define ADC_10_BIT_BATTERY_CURRENT_MAX                            106     // 17 amps
 #define ADC_10_BIT_MOTOR_PHASE_CURRENT_MAX                        177     // 28 amps
 
+// cycle-by-cycle peak current limit (PWM interrupt): raw battery current sample above the ceiling
+// cuts the duty cycle by (excess * duty cycle) >> BATTERY_CURRENT_PEAK_DUTY_CYCLE_SHIFT + 1
+#define ADC_10_BIT_BATTERY_CURRENT_PEAK                           131     // 21 amps
+#define BATTERY_CURRENT_PEAK_DUTY_CYCLE_SHIFT                     7
+
+// fast motor stall detection (PWM interrupt): rotor stopped (no forward Hall transition since the last
+// one or the motor launch for MOTOR_STALL_HALL_PWM_CYCLES, much longer than a low speed Hall sector)
+// and phase current above threshold for MOTOR_STALL_PWM_CYCLES: a motor blocked at launch is cut after
+// about 110ms. PWM cycles at 18 kHz, scaled to the active period with PWM_FREQUENCY_SELECT
+#define MOTOR_STALL_HALL_PWM_CYCLES                               (uint16_t)(PWM_CYCLES_SECOND/10)  // 100ms
+#define MOTOR_STALL_ADC_PHASE_CURRENT                             150     // 24 amps
+#define MOTOR_STALL_PWM_CYCLES                                    (uint8_t)(PWM_CYCLES_SECOND/100)  // 10ms
+
 /*---------------------------------------------------------
  NOTE: regarding ADC battery current max
 
@@ -172,6 +418,13 @@ HALL_COUNTER_OFFSET_UP:    29 -> 44
  transitions. Depending on if all transitions are measured or simply
  transitions of the same kind it is important to adjust the calculation of
  pedal cadence.
+
+ PAS1 (PE0) shares the port E interrupt with Hall sensor A, PAS2 (PD7) is
+ the TLI pin: the top level interrupt has a single edge sensitivity, toggled
+ at every edge, and it can't be masked (it may interrupt any routine). Each
+ interrupt stores the TIM3 timestamp and the PAS1/PAS2 state of the edge in
+ its own FIFO (single writer), calc_cadence() merges the two FIFOs by
+ timestamp every 30ms.
  -------------------------------------------------------------------------------*/
 
 
@@ -223,4 +476,86 @@ to avoid overflow max value of MAX_POWER_CALC_CONST is 255, so divide constant b
 #define FOC_MULTIPLICATOR_36V							  		27U;
 #define FOC_MULTIPLICATOR_48V									35U;
 
+/*---------------------------------------------------------
+ NOTE: regarding page zero RAM
+
+ The working set of the PWM and Hall interrupts is placed
+ at fixed addresses in page zero (0x00-0xFF) so every access
+ uses the short addressing mode (one byte less than long
+ addressing, 2 bytes less for mov). The other variables are
+ allocated by the linker from PAGE0_DATA_LOC: keep this
+ value in sync with --data-loc in the Makefiles.
+ Absolute variables are not initialized by the startup
+ code: they are set in hall_sensor_init().
+ "make check_page0" verifies the placement in main.map.
+ The interrupt cycle saving (fewer prefetch stalls) is an
+ estimate, not measured: check it with PWM_TIME_DEBUG.
+ ---------------------------------------------------------*/
+#define PAGE0_UI16_A                            0x01
+#define PAGE0_UI16_B                            0x03
+#define PAGE0_UI16_C                            0x05
+#define PAGE0_UI8_TEMP                          0x07
+#define PAGE0_UI8_G_DUTY_CYCLE                  0x08
+#define PAGE0_UI16_HALL_COUNTER_TOTAL           0x09
+#define PAGE0_UI8_HALL_STATE_IRQ                0x0B
+#define PAGE0_UI8_HALL_60_REF_IRQ               0x0C // 2 bytes
+#define PAGE0_UI16_HALL_60_REF_OLD              0x0E
+#define PAGE0_UI8_HALL_COUNTER_OFFSET           0x10
+#define PAGE0_UI8_FW_HALL_COUNTER_OFFSET        0x11
+#define PAGE0_UI8_MOTOR_PHASE_ABSOLUTE_ANGLE    0x12
+#define PAGE0_UI8_G_FOC_ANGLE                   0x13
+#define PAGE0_UI8_FOC_ANGLE_ACCUMULATED         0x14
+#define PAGE0_UI8_FOC_FLAG                      0x15
+#define PAGE0_UI8_ADC_BATTERY_CURRENT_ACC       0x16
+#define PAGE0_UI8_ADC_BATTERY_CURRENT_FILTERED  0x17
+#define PAGE0_UI8_ADC_MOTOR_PHASE_CURRENT       0x18
+#define PAGE0_UI8_MOTOR_COMMUTATION_TYPE        0x19
+#define PAGE0_UI8_PWM_MIDDLE_COUNTER            0x1A // PWM_FREQUENCY_SELECT only
+#define PAGE0_UI8_HALL_SECTOR_ANGLE             0x1B
+#define PAGE0_UI8_PWM_DUTY_CYCLE                0x1C // PWM_FREQUENCY_SELECT only
+#define PAGE0_END                               0x1D
+#define PAGE0_DATA_LOC                          0x20
+
+#if PAGE0_END > PAGE0_DATA_LOC
+#error "page zero working set overlaps the linker data area"
+#endif
+
+#ifdef __CDT_PARSER__
+#define __at(x) // Disable Eclipse syntax check on absolute address keyword
+#endif
+
+/*---------------------------------------------------------
+ NOTE: regarding single shunt phase current reconstruction
+
+ With SINGLE_SHUNT_FOC defined, every second PWM cycle the
+ OC4 compare (ADC trigger and PWM interrupt) is moved from
+ the middle of the counter to two sampling points:
+ - down counting, between the highest and the middle phase
+   compare values: the shunt carries +I of the highest phase
+ - up counting, between the middle and the lowest phase
+   compare values: the shunt carries -I of the lowest phase
+ Only channel 5 is converted on these two triggers, the
+ other PWM cycle runs the normal ADC scan.
+
+ The two samples are rebuilt into the three phase currents
+ and the Id/Iq components are calculated in the main loop.
+ Id is driven to zero by a PI that sets the FOC angle
+ (direction of the voltage vector), the measured Iq limits
+ the motor phase current. The voltage vector amplitude
+ stays controlled by the duty cycle ramps.
+
+ Samples are skipped when a window is shorter than the
+ dead time + amplifier settling time. Note that the current
+ amplifier output must not be low pass filtered for this
+ mode to work.
+ ---------------------------------------------------------*/
+#define SINGLE_SHUNT_DEAD_TIME                  32  // TIM1 counts, same value as the TIM1 dead time
+#define SINGLE_SHUNT_SETTLING_TIME              24  // TIM1 counts, current amplifier settling time
+#define SINGLE_SHUNT_SAMPLE_MARGIN              12  // TIM1 counts from ADC trigger to end of sampling
+#define SINGLE_SHUNT_WINDOW_MIN                 (SINGLE_SHUNT_DEAD_TIME + SINGLE_SHUNT_SETTLING_TIME + SINGLE_SHUNT_SAMPLE_MARGIN)
+#define SINGLE_SHUNT_IRQ_SPACING_MIN            320 // TIM1 counts between the two sampling points (down irq execution time)
+#define SINGLE_SHUNT_ID_KP                      16  // FOC angle x256 for each Id ADC step
+#define SINGLE_SHUNT_ID_KI                      1   // FOC angle x256 integrated for each Id ADC step every sample
+#define SINGLE_SHUNT_FOC_ANGLE_MAX              15
+
 #endif // _MAIN_H_
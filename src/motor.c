@@ -20,6 +20,7 @@
 #include "uart.h"
 #include "adc.h"
 #include "common.h"
+#include "pas.h"
 
 #define SVM_TABLE_LEN   256
 
@@ -37,9 +38,9 @@ static const uint8_t ui8_svm_table[SVM_TABLE_LEN] = { 208, 209, 210, 212, 213, 2
 
 // motor variables
 uint8_t ui8_hall_360_ref_valid = 0;
-uint8_t ui8_motor_commutation_type = BLOCK_COMMUTATION;
-static uint8_t ui8_motor_phase_absolute_angle;
-volatile uint16_t ui16_hall_counter_total = 0xffff;
+uint8_t __at(PAGE0_UI8_MOTOR_COMMUTATION_TYPE) ui8_motor_commutation_type;
+static uint8_t __at(PAGE0_UI8_MOTOR_PHASE_ABSOLUTE_ANGLE) ui8_motor_phase_absolute_angle;
+volatile uint16_t __at(PAGE0_UI16_HALL_COUNTER_TOTAL) ui16_hall_counter_total;
 volatile uint16_t ui16_motor_speed_erps = 0;
 volatile uint8_t ui8_hall_sensors_state = 0;
 
@@ -47,24 +48,107 @@ volatile uint8_t ui8_hall_sensors_state = 0;
 volatile uint8_t ui8_controller_duty_cycle_ramp_up_inverse_step = PWM_DUTY_CYCLE_RAMP_UP_INVERSE_STEP_DEFAULT;
 volatile uint8_t ui8_controller_duty_cycle_ramp_down_inverse_step = PWM_DUTY_CYCLE_RAMP_DOWN_INVERSE_STEP_DEFAULT;
 volatile uint16_t ui16_adc_voltage_cut_off = 0xfff;
-volatile uint8_t ui8_adc_battery_current_filtered = 0;
+volatile uint8_t __at(PAGE0_UI8_ADC_BATTERY_CURRENT_FILTERED) ui8_adc_battery_current_filtered;
 volatile uint8_t ui8_controller_adc_battery_current_target = 0;
-volatile uint8_t ui8_g_duty_cycle = 0;
+volatile uint8_t __at(PAGE0_UI8_G_DUTY_CYCLE) ui8_g_duty_cycle;
 volatile uint8_t ui8_controller_duty_cycle_target = 0;
-volatile uint8_t ui8_g_foc_angle = 0;
-static uint8_t ui8_foc_angle_accumulated;
-static uint8_t ui8_foc_flag;
+// targets set every 30ms by ebike_control_motor(), the controller targets above are slewed to these values
+// by one unit every ..._slew_inverse_step PWM cycles
+volatile uint8_t ui8_controller_adc_battery_current_target_set = 0;
+volatile uint8_t ui8_controller_adc_battery_current_slew_inverse_step = 0;
+volatile uint8_t ui8_controller_duty_cycle_target_set = 0;
+volatile uint8_t ui8_controller_duty_cycle_slew_inverse_step = 0;
+static uint8_t ui8_counter_adc_battery_current_slew = 0;
+static uint8_t ui8_counter_duty_cycle_slew = 0;
+volatile uint8_t __at(PAGE0_UI8_G_FOC_ANGLE) ui8_g_foc_angle;
+static uint8_t __at(PAGE0_UI8_FOC_ANGLE_ACCUMULATED) ui8_foc_angle_accumulated;
+static uint8_t __at(PAGE0_UI8_FOC_FLAG) ui8_foc_flag;
+
+#ifdef PWM_FREQUENCY_SELECT
+// PWM frequency table (see NOTE in main.h)
+#define PWM_FREQUENCY_CYCLES_SECOND(arr)        (16000000UL / ((arr) * 2UL))
+#define PWM_FREQUENCY_OVER_SPEED_ERPS(arr)      ((PWM_FREQUENCY_CYCLES_SECOND(arr) / 29) < 650 ? (PWM_FREQUENCY_CYCLES_SECOND(arr) / 29) : 650)
+#define PWM_FREQUENCY_DUTY_CYCLE_MAX(middle, duty_max) \
+        (((duty_max) * (uint16_t)MIDDLE_PWM_COUNTER / (middle)) < PWM_DUTY_CYCLE_MAX ? \
+        ((duty_max) * (uint16_t)MIDDLE_PWM_COUNTER / (middle)) : PWM_DUTY_CYCLE_MAX)
+#define PWM_FREQUENCY_ENTRY(arr, middle, duty_max) { \
+        (arr), (middle), \
+        (uint8_t)PWM_FREQUENCY_DUTY_CYCLE_MAX(middle, duty_max), \
+        (uint8_t)((128U * (middle)) / MIDDLE_PWM_COUNTER), \
+        (uint16_t)(HALL_COUNTER_FREQ / PWM_FREQUENCY_OVER_SPEED_ERPS(arr)), \
+        (uint8_t)((128UL * PWM_COUNTER_MAX + (arr) / 2) / (arr)), \
+        (uint16_t)(PWM_FREQUENCY_CYCLES_SECOND(arr) / 10), \
+        (uint8_t)(PWM_FREQUENCY_CYCLES_SECOND(arr) / 100) }
+
+typedef struct _pwm_frequency {
+    uint16_t ui16_counter_max;              // TIM1 ARR
+    uint8_t ui8_middle_counter;             // PWM compare values center / 2
+    uint8_t ui8_duty_cycle_max;             // in MIDDLE_PWM_COUNTER units, scaled: (221 - MIDDLE_SVM_TABLE) * duty_cycle_max / 256 <= middle_counter
+    uint8_t ui8_duty_cycle_scale_x128;      // compare amplitude for each MIDDLE_PWM_COUNTER duty cycle unit x128 (rounded down)
+    uint16_t ui16_hall_counter_total_min;   // motor over speed
+    uint8_t ui8_ramp_scale_x128;            // PWM cycles for each PWM_CYCLES_SECOND cycle x128
+    uint16_t ui16_motor_stall_hall_cycles;  // MOTOR_STALL_HALL_PWM_CYCLES at this period
+    uint8_t ui8_motor_stall_cycles;         // MOTOR_STALL_PWM_CYCLES at this period
+} struct_pwm_frequency;
+
+static struct_pwm_frequency m_pwm_frequency_table[PWM_FREQUENCY_NUMBER] = {
+        PWM_FREQUENCY_ENTRY(PWM_FREQUENCY_HIGH_COUNTER_MAX, PWM_FREQUENCY_HIGH_COUNTER_MAX / 4, 232),
+        PWM_FREQUENCY_ENTRY(PWM_COUNTER_MAX, MIDDLE_PWM_COUNTER, PWM_DUTY_CYCLE_MAX),
+        PWM_FREQUENCY_ENTRY(PWM_FREQUENCY_LOW_COUNTER_MAX, PWM_FREQUENCY_LOW_COUNTER_MAX / 4, PWM_DUTY_CYCLE_MAX) };
+
+volatile uint8_t ui8_pwm_frequency_request = PWM_FREQUENCY_DEFAULT;
+volatile uint8_t ui8_pwm_frequency_index = PWM_FREQUENCY_DEFAULT;
+volatile uint8_t ui8_pwm_ramp_scale_x128 = 128;
+uint8_t __at(PAGE0_UI8_PWM_MIDDLE_COUNTER) ui8_pwm_middle_counter;
+// ui8_g_duty_cycle (MIDDLE_PWM_COUNTER units for the same phase voltage at any period) scaled to the current period
+static uint8_t __at(PAGE0_UI8_PWM_DUTY_CYCLE) ui8_pwm_duty_cycle;
+static uint8_t ui8_pwm_duty_cycle_scale_x128 = 128;
+static uint8_t ui8_pwm_duty_cycle_max = PWM_DUTY_CYCLE_MAX;
+// new period to be set by the up interrupt (compare values calculated for the new middle value)
+static uint8_t ui8_pwm_frequency_switch = 0;
+static uint16_t ui16_pwm_hall_counter_total_min = HALL_COUNTER_FREQ / MOTOR_OVER_SPEED_ERPS;
+static uint16_t ui16_pwm_counter_max = PWM_COUNTER_MAX;
+static uint16_t ui16_pwm_motor_stall_hall_cycles = MOTOR_STALL_HALL_PWM_CYCLES;
+static uint8_t ui8_pwm_motor_stall_cycles = MOTOR_STALL_PWM_CYCLES;
+
+#define MIDDLE_PWM_COUNTER_ASM          _ui8_pwm_middle_counter+0
+#define MIDDLE_PWM_COUNTER_IRQ          ui8_pwm_middle_counter
+#define DUTY_CYCLE_SVM_ASM              _ui8_pwm_duty_cycle+0
+#define PWM_DUTY_CYCLE_MAX_IRQ          ui8_pwm_duty_cycle_max
+#define HALL_COUNTER_TOTAL_MIN_IRQ      ui16_pwm_hall_counter_total_min
+#define PWM_COUNTER_MAX_IRQ             ui16_pwm_counter_max
+#define MOTOR_STALL_HALL_PWM_CYCLES_IRQ ui16_pwm_motor_stall_hall_cycles
+#define MOTOR_STALL_PWM_CYCLES_IRQ      ui8_pwm_motor_stall_cycles
+#else
+#define MIDDLE_PWM_COUNTER_ASM          #MIDDLE_PWM_COUNTER
+#define MIDDLE_PWM_COUNTER_IRQ          MIDDLE_PWM_COUNTER
+#define DUTY_CYCLE_SVM_ASM              _ui8_g_duty_cycle+0
+#define PWM_DUTY_CYCLE_MAX_IRQ          PWM_DUTY_CYCLE_MAX
+#define HALL_COUNTER_TOTAL_MIN_IRQ      (HALL_COUNTER_FREQ / MOTOR_OVER_SPEED_ERPS)
+#define PWM_COUNTER_MAX_IRQ             PWM_COUNTER_MAX
+#define MOTOR_STALL_HALL_PWM_CYCLES_IRQ MOTOR_STALL_HALL_PWM_CYCLES
+#define MOTOR_STALL_PWM_CYCLES_IRQ      MOTOR_STALL_PWM_CYCLES
+#endif
+
+// PWM outputs state (enabled by pwm_init())
+volatile uint8_t ui8_g_motor_pwm_enabled = 1;
+
+// hardware over current (TIM1 break input), latched until motor_break_recovery()
+volatile uint8_t ui8_g_hardware_overcurrent = 0;
+volatile uint8_t ui8_hardware_overcurrent_counter = 0;
 
 // Field Weakening Hall offset (added during interpolation)
-volatile uint8_t ui8_fw_hall_counter_offset = 0;
+volatile uint8_t __at(PAGE0_UI8_FW_HALL_COUNTER_OFFSET) ui8_fw_hall_counter_offset;
 volatile uint8_t ui8_g_field_weakening_enable = 0;
 
 static uint8_t ui8_counter_duty_cycle_ramp_up = 0;
 static uint8_t ui8_counter_duty_cycle_ramp_down = 0;
 
 // extra current variables
-static uint8_t ui8_adc_battery_current_acc = 0;
-volatile uint8_t ui8_adc_motor_phase_current;
+static uint8_t __at(PAGE0_UI8_ADC_BATTERY_CURRENT_ACC) ui8_adc_battery_current_acc;
+static uint8_t ui8_adc_battery_current_raw;
+volatile uint8_t ui8_battery_current_peak_counter = 0;
+volatile uint8_t __at(PAGE0_UI8_ADC_MOTOR_PHASE_CURRENT) ui8_adc_motor_phase_current;
 
 // ADC Values
 volatile uint16_t ui16_adc_voltage;
@@ -72,27 +156,30 @@ volatile uint16_t ui16_adc_torque;
 volatile uint16_t ui16_adc_torque_filtered;
 volatile uint16_t ui16_adc_throttle;
 
+// PWM interrupt timing (TIM1 counts, 62.5ns): execution time from the OC4 match, interrupts disabled window
+// and OC4 matches already pending at the interrupt end (reset by ebike_app when reported)
+volatile uint16_t ui16_pwm_irq_overrun_counter = 0;
+volatile uint16_t ui16_pwm_irq_up_time_max = 0;
+volatile uint16_t ui16_pwm_irq_down_time_max = 0;
+volatile uint8_t ui8_pwm_irq_sim_time_max = 0;
+static uint16_t ui16_pwm_irq_time;
+static uint8_t ui8_pwm_irq_sim_start;
+static uint8_t ui8_pwm_irq_sim_time;
+volatile uint16_t ui16_pwm_irq_load_time = 0;
+volatile uint16_t ui16_pwm_irq_load_period = 0;
+static uint16_t ui16_pwm_irq_load_time_acc = 0;
+static uint16_t ui16_pwm_irq_load_period_acc = 0;
+static uint8_t ui8_pwm_irq_load_cycles = 0;
+
+// motor stall (latched, cleared by ebike_app when the motor blocked error is reset)
+volatile uint8_t ui8_g_motor_stalled = 0;
+static uint8_t ui8_motor_stall_counter = 0;
+// PWM cycles from the last forward Hall transition (or from motor_hall_align())
+static uint16_t ui16_motor_stall_hall_cycles = 0;
+
 // brakes
 volatile uint8_t ui8_brake_state = 0;
-
-// cadence sensor
-#define NO_PAS_REF 5
-volatile uint16_t ui16_cadence_sensor_ticks = 0;
-volatile uint32_t ui32_crank_revolutions_x20 = 0;
-static uint16_t ui16_cadence_sensor_ticks_counter_min = CADENCE_SENSOR_CALC_COUNTER_MIN;
-static uint8_t ui8_pas_state_old = 4;
-static uint16_t ui16_cadence_calc_counter, ui16_cadence_stop_counter;
-static uint8_t ui8_cadence_calc_ref_state = NO_PAS_REF;
-const static uint8_t ui8_pas_old_valid_state[4] = { 0x01, 0x03, 0x00, 0x02 };
-
-// wheel speed sensor
-volatile uint16_t ui16_wheel_speed_sensor_ticks = 0;
-volatile uint16_t ui16_wheel_speed_sensor_ticks_counter_min = 0;
-volatile uint32_t ui32_wheel_speed_sensor_ticks_total = 0;
-
-// 1 = PAS state value changed
-// 0x80  = PAS state invalid -> reset
-volatile uint8_t ui8_pas_new_transition = 0;
+volatile uint8_t ui8_brake_fast_stop_counter = 0;
 
 // Measures did with a 24V Q85 328 RPM motor, rotating motor backwards by hand:
 // Hall sensor A positivie to negative transition | BEMF phase B at max value / top of sinewave
@@ -117,20 +204,20 @@ extern volatile uint8_t ui8_main_time;
 // and then:
 // Up interrupt is used for:
 //  - read and filter battery current
-//  - read PAS sensor and cadence computation
 //  - check brake (coaster brake and brake input signal)
 //  - update duty cycle
 // Down interrupt is used for:
 //  - calculate rotor position (based on HAL sensors state and interpolation based on counters)
 //  - Apply phase voltage and duty cycle to TIM1 outputs according to rotor position
-//  - Read Wheel speed sensor and wheel speed computation
+// Wheel speed sensor: edge interrupt and TIM3 timestamps (wheel_speed_sensor.c)
+// PAS sensors: edge interrupts and TIM3 timestamps (Hall A port interrupt and pas.c)
 
 #ifdef __CDT_PARSER__
 #define __interrupt(x)  // Disable Eclipse syntax check on interrupt keyword
 #endif
 
-volatile uint8_t  ui8_hall_state_irq = 0;
-volatile uint8_t  ui8_hall_60_ref_irq[2];
+volatile uint8_t  __at(PAGE0_UI8_HALL_STATE_IRQ) ui8_hall_state_irq;
+volatile uint8_t  __at(PAGE0_UI8_HALL_60_REF_IRQ) ui8_hall_60_ref_irq[2];
 
 
 // Interrupt routines called on Hall sensor state change (Highest priority)
@@ -139,28 +226,175 @@ volatile uint8_t  ui8_hall_60_ref_irq[2];
 //      - Hall A: bit 0
 //      - Hall B: bit 1
 //      - Hall C: bit 2
-void HALL_SENSOR_A_PORT_IRQHandler(void)  __interrupt(EXTI_HALL_A_IRQ) {
-    ui8_hall_60_ref_irq[0] = TIM3->CNTRH;
-    ui8_hall_60_ref_irq[1] = TIM3->CNTRL;
-    ui8_hall_state_irq &= (unsigned char)~0x01;
-    if (HALL_SENSOR_A__PORT->IDR & HALL_SENSOR_A__PIN)
-        ui8_hall_state_irq |= (unsigned char)0x01;
+// Naked routines: CC, A, X, Y and PC are saved by the interrupt hardware and no compiler
+// prologue runs before the first instruction, the TIM3 counter is read at a fixed latency
+// from the Hall edge (interrupt hardware entry only). Hall interrupts are not nested (all
+// priority 3) and the PWM interrupt is masked while they run: bit operations are safe.
+// Ports D and E are shared with the PAS sensors: the Hall transition reference is updated
+// only if the Hall signal changed.
+
+// Port E is shared with PAS1: a PAS1 edge is stored with its timestamp in the PAS1 FIFO
+void HALL_SENSOR_A_PORT_IRQHandler(void) __interrupt(EXTI_HALL_A_IRQ) __naked {
+    /*
+    uint16_t ui16_timestamp = TIM3 counter;
+    uint8_t ui8_port_e = HALL_SENSOR_A__PORT->IDR;
+    uint8_t ui8_hall_a = 0;
+
+    if (ui8_port_e & HALL_SENSOR_A__PIN)
+        ui8_hall_a = 0x01;
+    if ((ui8_hall_state_irq & 0x01) != ui8_hall_a) {
+        ui8_hall_60_ref_irq[0] = (uint8_t)(ui16_timestamp >> 8);
+        ui8_hall_60_ref_irq[1] = (uint8_t)ui16_timestamp;
+        ui8_hall_state_irq ^= (unsigned char)0x01;
+    }
+
+    ui8_port_e &= PAS1__PIN;
+    if (ui8_port_e != ui8_pas1_state_irq) {
+        ui8_pas1_state_irq = ui8_port_e;
+        if (PAS2__PORT->IDR & PAS2__PIN)
+            ui8_port_e |= 0x02;
+        ui8_pas1_fifo_state[ui8_pas1_fifo_write_index & (PAS_FIFO_SIZE - 1)] = ui8_port_e;
+        ui16_pas1_fifo_timestamp[ui8_pas1_fifo_write_index & (PAS_FIFO_SIZE - 1)] = ui16_timestamp;
+        ui8_pas1_fifo_write_index++;
+    }
+    */
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        ldw x, 0x5328                       // TIM3->CNTRH, TIM3->CNTRL
+        ld  a, 0x5015                       // ui8_port_e = HALL_SENSOR_A__PORT->IDR (PE5 Hall A, PE0 PAS1)
+        bcp a, #0x20
+        jreq 00001$
+        btjt _ui8_hall_state_irq+0, #0, 00003$  // Hall A high, not changed
+        jra 00002$
+    00001$:
+        btjf _ui8_hall_state_irq+0, #0, 00003$  // Hall A low, not changed
+    00002$:
+        ldw _ui8_hall_60_ref_irq+0, x
+        bcpl _ui8_hall_state_irq+0, #0
+    00003$:
+        and a, #0x01                        // PAS1
+        cp  a, _ui8_pas1_state_irq+0
+        jreq 00005$                         // PAS1 not changed
+        ld  _ui8_pas1_state_irq+0, a
+        btjf 0x5010, #7, 00004$             // PAS2__PORT->IDR (PD7)
+        or  a, #0x02
+    00004$:
+        push a
+        ld  a, _ui8_pas1_fifo_write_index+0
+        and a, #0x07                        // PAS_FIFO_SIZE - 1
+        clrw y
+        ld  yl, a
+        pop a
+        ld  (_ui8_pas1_fifo_state, y), a
+        sllw y
+        ldw (_ui16_pas1_fifo_timestamp, y), x
+        inc _ui8_pas1_fifo_write_index+0
+    00005$:
+        iret
+    __endasm;
+    #endif
 }
 
-void HALL_SENSOR_B_PORT_IRQHandler(void) __interrupt(EXTI_HALL_B_IRQ)  {
-    ui8_hall_60_ref_irq[0] = TIM3->CNTRH;
-    ui8_hall_60_ref_irq[1] = TIM3->CNTRL;
-    ui8_hall_state_irq &= (unsigned char)~0x02;
+// Port D: PD7 (PAS2) is the TLI pin, PAS2 edges don't trigger this interrupt
+void HALL_SENSOR_B_PORT_IRQHandler(void) __interrupt(EXTI_HALL_B_IRQ) __naked {
+    /*
+    uint16_t ui16_timestamp = TIM3 counter;
+    uint8_t ui8_hall_b = 0;
+
     if (HALL_SENSOR_B__PORT->IDR & HALL_SENSOR_B__PIN)
-        ui8_hall_state_irq |= (unsigned char)0x02;
+        ui8_hall_b = 0x02;
+    if ((ui8_hall_state_irq & 0x02) != ui8_hall_b) {
+        ui8_hall_60_ref_irq[0] = (uint8_t)(ui16_timestamp >> 8);
+        ui8_hall_60_ref_irq[1] = (uint8_t)ui16_timestamp;
+        ui8_hall_state_irq ^= (unsigned char)0x02;
+    }
+    */
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        ldw x, 0x5328                       // TIM3->CNTRH, TIM3->CNTRL
+        btjf 0x5010, #2, 00001$             // HALL_SENSOR_B__PORT->IDR (PD2)
+        btjt _ui8_hall_state_irq+0, #1, 00003$  // Hall B high, not changed
+        jra 00002$
+    00001$:
+        btjf _ui8_hall_state_irq+0, #1, 00003$  // Hall B low, not changed
+    00002$:
+        ldw _ui8_hall_60_ref_irq+0, x
+        bcpl _ui8_hall_state_irq+0, #1
+    00003$:
+        iret
+    __endasm;
+    #endif
 }
 
-void HALL_SENSOR_C_PORT_IRQHandler(void) __interrupt(EXTI_HALL_C_IRQ)  {
-    ui8_hall_60_ref_irq[0] = TIM3->CNTRH;
-    ui8_hall_60_ref_irq[1] = TIM3->CNTRL;
-    ui8_hall_state_irq &= (unsigned char)~0x04;
-    if (HALL_SENSOR_C__PORT->IDR & HALL_SENSOR_C__PIN)
-        ui8_hall_state_irq |= (unsigned char)0x04;
+// Port C is shared with the brake input: the Hall transition reference is updated only
+// if Hall C changed, the brake falling edge (brake engaged) gates the PWM outputs at once
+// when fast stop is enabled.
+void HALL_SENSOR_C_PORT_IRQHandler(void) __interrupt(EXTI_HALL_C_IRQ) __naked {
+    /*
+    uint16_t ui16_hall_c_ref = TIM3 counter;
+    uint8_t ui8_port_c = HALL_SENSOR_C__PORT->IDR;
+    uint8_t ui8_hall_c = 0;
+
+    if (ui8_port_c & HALL_SENSOR_C__PIN)
+        ui8_hall_c = 0x04;
+    if ((ui8_hall_state_irq & 0x04) != ui8_hall_c) {
+        ui8_hall_60_ref_irq[0] = (uint8_t)(ui16_hall_c_ref >> 8);
+        ui8_hall_60_ref_irq[1] = (uint8_t)ui16_hall_c_ref;
+        ui8_hall_state_irq ^= (unsigned char)0x04;
+    }
+
+    if (!(ui8_port_c & BRAKE__PIN) && ui8_brake_fast_stop && ui8_g_motor_pwm_enabled) {
+        TIM1->CCER1 &= (uint8_t)~(TIM1_CCER1_CC1E | TIM1_CCER1_CC1NE | TIM1_CCER1_CC2E | TIM1_CCER1_CC2NE);
+        TIM1->CCER2 &= (uint8_t)~(TIM1_CCER2_CC3E | TIM1_CCER2_CC3NE);
+        ui8_g_motor_pwm_enabled = 0;
+        ui8_g_duty_cycle = 0;
+        ui8_controller_duty_cycle_target = 0;
+        ui8_controller_duty_cycle_target_set = 0;
+        ui8_brake_state = 1;
+        if (ui8_brake_fast_stop_counter < 255) {
+            ui8_brake_fast_stop_counter++;
+        }
+    }
+    */
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        ldw x, 0x5328                       // TIM3->CNTRH, TIM3->CNTRL
+        ld  a, 0x500b                       // ui8_port_c = HALL_SENSOR_C__PORT->IDR (PC5 Hall C, PC6 brake)
+        bcp a, #0x20
+        jreq 00001$
+        btjt _ui8_hall_state_irq+0, #2, 00003$  // Hall C high, not changed
+        jra 00002$
+    00001$:
+        btjf _ui8_hall_state_irq+0, #2, 00003$  // Hall C low, not changed
+    00002$:
+        ldw _ui8_hall_60_ref_irq+0, x
+        bcpl _ui8_hall_state_irq+0, #2
+    00003$:
+        bcp a, #0x40                        // brake engaged (low)
+        jrne 00004$
+        tnz _ui8_brake_fast_stop+0
+        jreq 00004$
+        tnz _ui8_g_motor_pwm_enabled+0
+        jreq 00004$
+        ld  a, 0x525c                       // TIM1->CCER1: clear CC1E, CC1NE, CC2E, CC2NE
+        and a, #0xaa
+        ld  0x525c, a
+        ld  a, 0x525d                       // TIM1->CCER2: clear CC3E, CC3NE
+        and a, #0xfa
+        ld  0x525d, a
+        clr _ui8_g_motor_pwm_enabled+0
+        clr _ui8_g_duty_cycle+0
+        clr _ui8_controller_duty_cycle_target+0
+        clr _ui8_controller_duty_cycle_target_set+0
+        mov _ui8_brake_state+0, #1
+        ld  a, _ui8_brake_fast_stop_counter+0
+        inc a
+        jreq 00004$                         // saturated at 255
+        ld  _ui8_brake_fast_stop_counter+0, a
+    00004$:
+        iret
+    __endasm;
+    #endif
 }
 
 // Last rotor complete revolution Hall ticks
@@ -170,7 +404,28 @@ static uint16_t ui16_hall_360_ref;
 static uint8_t  ui8_hall_sensors_state_last = 7; // Invalid value, force execution of Hall code at the first run
 
 // Hall counter value of last Hall transition
-static uint16_t ui16_hall_60_ref_old;
+static uint16_t __at(PAGE0_UI16_HALL_60_REF_OLD) ui16_hall_60_ref_old;
+
+// ui16_hall_60_ref_old is a valid transition (rotor not stopped since then)
+static uint8_t ui8_hall_60_ref_valid = 0;
+
+// ui16_hall_counter_total estimated from a single sector interval, until the 360 degrees reference is available
+static uint8_t ui8_hall_counter_total_provisional = 0;
+
+// low speed interpolation: angle from the Hall transition (block commutation), last sector interval
+// and elapsed time since the last Hall transition, both extended with the Hall counter wraps
+static uint8_t __at(PAGE0_UI8_HALL_SECTOR_ANGLE) ui8_hall_sector_angle;
+static uint8_t ui8_low_speed_ref_valid = 0;
+static uint8_t ui8_low_speed_valid = 0;
+static uint16_t ui16_low_speed_sector;
+static uint8_t ui8_low_speed_sector_wraps;
+static uint16_t ui16_low_speed_elapsed_old;
+static uint8_t ui8_low_speed_wraps;
+// interpolation taking over from block commutation in the middle of the Hall sector: min angle of the first sector
+static uint8_t ui8_interpolation_angle_min = 0;
+
+// previous Hall state with forward rotation (sequence 0x06, 0x02, 0x03, 0x01, 0x05, 0x04)
+static const uint8_t ui8_hall_state_forward_previous[8] = { 0, 0x03, 0x06, 0x02, 0x05, 0x01, 0x04, 0 };
 
 // Hall calibration counter
 volatile uint16_t ui16_hall_calib_cnt[6];
@@ -194,33 +449,90 @@ volatile uint8_t ui8_hall_counter_offsets[6] = {
         HALL_COUNTER_OFFSET_DOWN};
 
 // Hall offset for current Hall state
-static uint8_t ui8_hall_counter_offset;
+static uint8_t __at(PAGE0_UI8_HALL_COUNTER_OFFSET) ui8_hall_counter_offset;
 
 // temporay variables (at the end of down irq stores phase a,b,c voltages)
-static uint16_t ui16_a;
-static uint16_t ui16_b;
-static uint16_t ui16_c;
-
-static uint8_t ui8_temp;
+static uint16_t __at(PAGE0_UI16_A) ui16_a;
+static uint16_t __at(PAGE0_UI16_B) ui16_b;
+static uint16_t __at(PAGE0_UI16_C) ui16_c;
+
+static uint8_t __at(PAGE0_UI8_TEMP) ui8_temp;
+
+#ifdef SINGLE_SHUNT_FOC
+// PWM cycle type
+#define SHUNT_SCAN_PERIOD       0   // OC4 in the middle of the counter, ADC scan of all channels
+#define SHUNT_SAMPLE_PERIOD     1   // OC4 on the two shunt sampling points, ADC conversion of channel 5 only
+static uint8_t ui8_shunt_period = SHUNT_SCAN_PERIOD;
+// counter direction of the next expected OC4 interrupt
+static uint8_t ui8_shunt_irq_dir = 0;
+// sorted phase compare values (phase with the highest, middle and lowest duty cycle)
+static uint16_t ui16_shunt_max;
+static uint16_t ui16_shunt_mid;
+static uint16_t ui16_shunt_min;
+// bit 4-5 = phase with the highest duty cycle, bit 0-1 = phase with the lowest duty cycle (0=A, 1=B, 2=C)
+static uint8_t ui8_shunt_order;
+// OC4 values of the two sampling points
+static uint16_t ui16_shunt_p1;
+static uint16_t ui16_shunt_p2;
+// voltage vector angle without the FOC angle (calculated in the down irq and latched for the sampling period)
+static uint8_t ui8_shunt_angle;
+static uint8_t ui8_shunt_sample_angle;
+static uint8_t ui8_shunt_sample_order;
+static uint16_t ui16_shunt_sample_1;
+
+// last sample pair, processed in the main loop by motor_foc_current_loop()
+volatile uint16_t ui16_shunt_sample_max;  // +I of the phase with the highest duty cycle
+volatile uint16_t ui16_shunt_sample_min;  // -I of the phase with the lowest duty cycle
+volatile uint8_t ui8_shunt_sample_pair_order;
+volatile uint8_t ui8_shunt_sample_pair_angle;
+volatile uint8_t ui8_shunt_new_sample = 0;
+
+// measured motor phase current (Iq component)
+volatile uint8_t ui8_foc_iq = 0;
+#endif
 
 void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
 {
+    // clear the OC4 flag at the start: if set again at the end the next match has been lost (overrun)
+    TIM1->SR1 = (uint8_t) (~(uint8_t) TIM1_IT_CC4);
+
+    #ifdef SINGLE_SHUNT_FOC
+    // during the sampling cycle OC4 matches also when the counter passes the sampling point
+    // in the opposite direction: skip these interrupts
+    if ((uint8_t)(TIM1->CR1 ^ ui8_shunt_irq_dir) & TIM1_CR1_DIR)
+        goto irq_end;
+    ui8_shunt_irq_dir ^= TIM1_CR1_DIR;
+    #endif
+
+    #ifdef PWM_SINGLE_IRQ
+    // one interrupt per PWM period (counting down): rotor angle and compare values first,
+    // then the work of the up interrupt (compare values update, ADC, duty cycle controller)
+    {
+    #else
     // bit 5 of TIM1->CR1 contains counter direction (0=up, 1=down)
     if (TIM1->CR1 & 0x10) {
+    #endif
         #ifndef __CDT_PARSER__ // disable Eclipse syntax check
         __asm
+            mov _ui8_pwm_irq_sim_start+0, 0x525f // TIM1->CNTRL
             push cc             // save current Interrupt Mask (I1,I0 bits of CC register)
             sim                 // disable interrupts  (set I0,I1 bits of CC register to 1,1)
                                 // Hall GPIO interrupt is buffered during this interval
             mov _ui8_temp+0, _ui8_hall_state_irq+0
             mov _ui16_b+0, _ui8_hall_60_ref_irq+0
             mov _ui16_b+1, _ui8_hall_60_ref_irq+1
-            mov _ui16_a+0, 0x5328 // TIM3->CNTRH
-            mov _ui16_a+1, 0x5329 // TIM3->CNTRL
+            pushw x             // TIM3 read by a single instruction: the PAS2 TLI can't be masked
+            ldw x, 0x5328       // TIM3->CNTRH, TIM3->CNTRL
+            ldw _ui16_a+0, x
+            popw x
             pop cc              // enable interrupts (restores previous value of Interrupt mask)
                                 // Hall GPIO buffered interrupt could fire now
         __endasm;
         #endif
+        // interrupts disabled window (Hall interrupt latency added by this interrupt), TIM1 counting down
+        ui8_pwm_irq_sim_time = ui8_pwm_irq_sim_start - TIM1->CNTRL;
+        if (ui8_pwm_irq_sim_time > ui8_pwm_irq_sim_time_max)
+            ui8_pwm_irq_sim_time_max = ui8_pwm_irq_sim_time;
         // ui8_temp stores the current Hall sensor state
         // ui16_b stores the Hall sensor counter value of the last transition
         // ui16_a stores the current Hall sensor counter value
@@ -244,6 +556,7 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
                 if (ui8_hall_sensors_state_last == ui8_hall_360_ref_valid) { // faster check
                     ui16_hall_counter_total = ui16_b - ui16_hall_360_ref;
                     ui8_motor_commutation_type = SINEWAVE_INTERPOLATION_60_DEGREES;
+                    ui8_hall_counter_total_provisional = 0;
                 }
                 ui8_hall_360_ref_valid = 0x03;
                 ui8_motor_phase_absolute_angle = ui8_hall_ref_angles[3]; // Rotor at 210 deg
@@ -263,8 +576,10 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
                         ui8_motor_phase_absolute_angle = ui8_hall_ref_angles[2]; // Rotor at 150 deg
                         ui8_hall_counter_offset = ui8_hall_counter_offsets[2];
                         ui16_hall_calib_cnt[2] = ui16_b - ui16_hall_60_ref_old;
+                        #ifndef SINGLE_SHUNT_FOC
                         // update ui8_g_foc_angle one time every ERPS
                         ui8_foc_flag = 1;
+                        #endif
                         break;
                     case 0x04:
                         ui8_motor_phase_absolute_angle = ui8_hall_ref_angles[5]; // Rotor at 330 deg
@@ -282,9 +597,48 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
                         ui16_hall_calib_cnt[0] = ui16_b - ui16_hall_60_ref_old;
                         break;
                     default:
-                        return;
+                        // invalid Hall state (0 or 7: glitch or sensor disconnected): zero phase voltage,
+                        // skip only the rotor angle calculation, the rest of the interrupt keeps running
+                        ui16_a = (uint16_t)MIDDLE_PWM_COUNTER_IRQ << 1;
+                        ui16_b = ui16_a;
+                        ui16_c = ui16_a;
+                        goto hall_state_invalid;
                 }
 
+            // start interpolation after one valid sector interval (forward rotation),
+            // ui16_hall_counter_total = 6 * last sector interval until the 360 degrees reference is available
+            ui8_interpolation_angle_min = 0;
+            if (((ui8_motor_commutation_type == BLOCK_COMMUTATION) || ui8_hall_counter_total_provisional)
+                    && ui8_hall_60_ref_valid
+                    && (ui8_hall_sensors_state_last == ui8_hall_state_forward_previous[ui8_temp])) {
+                // block commutation in the middle of the sector (no low speed interpolation, e.g. at launch):
+                // the interpolation starts from the same angle instead of jumping back to the sector start
+                if ((ui8_motor_commutation_type == BLOCK_COMMUTATION) && (!ui8_low_speed_valid))
+                    ui8_interpolation_angle_min = HALL_SECTOR_HALF_ANGLE;
+                ui16_hall_counter_total = (ui16_b - ui16_hall_60_ref_old) * 6;
+                ui8_motor_commutation_type = SINEWAVE_INTERPOLATION_60_DEGREES;
+                ui8_hall_counter_total_provisional = 1;
+            }
+            ui8_hall_60_ref_valid = 1;
+
+            // low speed interpolation: store the sector interval (forward rotation)
+            if (ui8_low_speed_ref_valid
+                    && (ui8_hall_sensors_state_last == ui8_hall_state_forward_previous[ui8_temp])) {
+                ui16_low_speed_sector = ui16_b - ui16_hall_60_ref_old;
+                ui8_low_speed_sector_wraps = ui8_low_speed_wraps;
+                ui8_low_speed_valid = 1;
+                ui8_hall_sector_angle = 0;
+            } else {
+                ui8_low_speed_valid = 0;
+                ui8_hall_sector_angle = HALL_SECTOR_HALF_ANGLE;
+            }
+            ui8_low_speed_ref_valid = 1;
+            ui8_low_speed_wraps = 0;
+            ui16_low_speed_elapsed_old = 0;
+            // stall check: only a forward transition shows the rotor turning (not a Hall sensor bouncing)
+            if (ui8_hall_sensors_state_last == ui8_hall_state_forward_previous[ui8_temp])
+                ui16_motor_stall_hall_cycles = 0;
+
             // update last hall sensor state
             #ifndef __CDT_PARSER__ // disable Eclipse syntax check
             __asm
@@ -303,6 +657,60 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
                 ui8_g_foc_angle = 0;
                 ui8_hall_360_ref_valid = 0;
                 ui16_hall_counter_total = 0xffff;
+                ui8_hall_60_ref_valid = 0;
+                ui8_hall_counter_total_provisional = 0;
+            }
+
+            // low speed interpolation (ui16_a and ui16_b are not used by block commutation)
+            if ((ui8_motor_commutation_type == BLOCK_COMMUTATION) && ui8_low_speed_ref_valid) {
+                ui16_a -= ui16_b; // Hall counter ticks from the last Hall sensor transition (low 16 bits)
+                if (ui16_a < ui16_low_speed_elapsed_old) {
+                    // Hall counter wrap
+                    if (++ui8_low_speed_wraps > LOW_SPEED_TIMER_WRAPS_MAX) {
+                        // rotor stopped: middle of the Hall sector
+                        ui8_low_speed_ref_valid = 0;
+                        ui8_low_speed_valid = 0;
+                        ui8_hall_sector_angle = HALL_SECTOR_HALF_ANGLE;
+                    }
+                }
+                ui16_low_speed_elapsed_old = ui16_a;
+
+                if (ui8_low_speed_valid) {
+                    if ((ui8_low_speed_wraps > ui8_low_speed_sector_wraps)
+                            || ((ui8_low_speed_wraps == ui8_low_speed_sector_wraps) && (ui16_a >= ui16_low_speed_sector))) {
+                        // never pass the next Hall sector
+                        ui8_hall_sector_angle = LOW_SPEED_SECTOR_ANGLE_MAX;
+                    } else {
+                        // scale elapsed time and sector interval to 15 bits (elapsed < sector)
+                        uint8_t ui8_sector_wraps = ui8_low_speed_sector_wraps;
+                        uint8_t ui8_elapsed_wraps = ui8_low_speed_wraps;
+                        uint8_t ui8_cnt = 6;
+                        uint8_t ui8_fraction = 0;
+
+                        ui16_b = ui16_low_speed_sector;
+                        while (ui8_sector_wraps || (ui16_b & 0x8000)) {
+                            ui16_b >>= 1;
+                            if (ui8_sector_wraps & 1)
+                                ui16_b |= 0x8000;
+                            ui8_sector_wraps >>= 1;
+                            ui16_a >>= 1;
+                            if (ui8_elapsed_wraps & 1)
+                                ui16_a |= 0x8000;
+                            ui8_elapsed_wraps >>= 1;
+                        }
+                        // ui8_fraction = (ui16_a << 6) / ui16_b, result < 64
+                        do {
+                            ui16_a <<= 1;
+                            ui8_fraction <<= 1;
+                            if (ui16_a >= ui16_b) {
+                                ui16_a -= ui16_b;
+                                ui8_fraction |= (uint8_t)0x01;
+                            }
+                        } while (--ui8_cnt);
+                        // 60 degrees = 43 * 64 / 64
+                        ui8_hall_sector_angle = (uint8_t)(((uint16_t)ui8_fraction * 43U) >> 6);
+                    }
+                }
             }
         }
 
@@ -311,8 +719,9 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         // - calculate interpolation angle and sine wave table index
 
         /*
-        ui8_temp = 0; // interpolation angle
+        ui8_temp = ui8_hall_sector_angle; // block commutation: middle of the Hall sector or low speed interpolation
         if (ui8_motor_commutation_type != BLOCK_COMMUTATION) {
+            ui8_temp = 0; // interpolation angle
             // ---------
             // uint8_t ui8_temp = ((uint32_t)ui16_a << 8) / ui16_hall_counter_total;
             // ---------
@@ -334,15 +743,40 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
                     ui8_temp |= (uint8_t)0x01;
                 }
             } while (--ui8_cnt);
+            if (ui8_temp < ui8_interpolation_angle_min)
+                ui8_temp = ui8_interpolation_angle_min;
         }
         // we need to put phase voltage 90 degrees ahead of rotor position, to get current 90 degrees ahead and have max torque per amp
         ui8_svm_table_index = ui8_temp + ui8_motor_phase_absolute_angle + ui8_g_foc_angle;
         */
+        #ifdef PWM_FREQUENCY_SELECT
+        // PWM frequency switch requested by ebike_app: the compare values of this period are calculated
+        // for the new middle value, the new period is set by the up interrupt when they are loaded
+        if ((ui8_pwm_frequency_request != ui8_pwm_frequency_index) && (!ui8_pwm_frequency_switch)) {
+            struct_pwm_frequency *p_pwm_frequency = &m_pwm_frequency_table[ui8_pwm_frequency_request];
+
+            ui8_pwm_middle_counter = p_pwm_frequency->ui8_middle_counter;
+            ui8_pwm_duty_cycle_scale_x128 = p_pwm_frequency->ui8_duty_cycle_scale_x128;
+            ui8_pwm_duty_cycle_max = p_pwm_frequency->ui8_duty_cycle_max;
+            if (ui8_g_duty_cycle > ui8_pwm_duty_cycle_max)
+                ui8_g_duty_cycle = ui8_pwm_duty_cycle_max;
+            ui16_pwm_hall_counter_total_min = p_pwm_frequency->ui16_hall_counter_total_min;
+            ui8_pwm_ramp_scale_x128 = p_pwm_frequency->ui8_ramp_scale_x128;
+            ui16_pwm_motor_stall_hall_cycles = p_pwm_frequency->ui16_motor_stall_hall_cycles;
+            ui8_pwm_motor_stall_cycles = p_pwm_frequency->ui8_motor_stall_cycles;
+            ui8_pwm_frequency_index = ui8_pwm_frequency_request;
+            ui8_pwm_frequency_switch = 1;
+        }
+        // same phase voltage for the same ui8_g_duty_cycle at any PWM period
+        ui8_pwm_duty_cycle = (uint8_t)(((uint16_t)ui8_g_duty_cycle * ui8_pwm_duty_cycle_scale_x128) >> 7);
+        #endif
         #ifndef __CDT_PARSER__ // disable Eclipse syntax check
         __asm
-            clr _ui8_temp+0
+            // block commutation: voltage vector in the middle of the Hall sector or low speed interpolation
+            mov _ui8_temp+0, _ui8_hall_sector_angle+0
             tnz _ui8_motor_commutation_type+0
             jreq 00011$
+            clr _ui8_temp+0
             // ui16_a = ((ui16_a - ui16_b) + ui8_fw_hall_counter_offset + ui8_hall_counter_offset) << 2;
             ld  a, _ui8_fw_hall_counter_offset+0
             add a, _ui8_hall_counter_offset+0
@@ -363,6 +797,12 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             dec _ui16_b+0
             jrne 00012$
             // now ui8_temp contains the interpolation angle
+            // if (ui8_temp < ui8_interpolation_angle_min) ui8_temp = ui8_interpolation_angle_min;
+            ld  a, _ui8_temp+0
+            cp  a, _ui8_interpolation_angle_min+0
+            jrnc 00011$
+            ld  a, _ui8_interpolation_angle_min+0
+            ld  _ui8_temp+0, a
         00011$: // BLOCK_COMMUTATION
             // ui8_temp = ui8_temp + ui8_motor_phase_absolute_angle + ui8_g_foc_angle;
             ld  a, _ui8_temp+0
@@ -401,12 +841,12 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             // ui16_a = (uint16_t)((uint8_t)(ui8_temp - MIDDLE_SVM_TABLE) * (uint8_t)ui8_g_duty_cycle);
             sub a, #MIDDLE_SVM_TABLE
             ld  xl, a
-            ld  a, _ui8_g_duty_cycle+0
+            ld  a, DUTY_CYCLE_SVM_ASM
             mul x, a
             // ui16_a = (uint8_t)(MIDDLE_PWM_COUNTER + (uint8_t) (ui16_a >> 8)) << 1;
             ld  a, xh
             clr _ui16_a+0
-            add a, #MIDDLE_PWM_COUNTER
+            add a, MIDDLE_PWM_COUNTER_ASM
             jrpl 00022$
             mov _ui16_a+0, #0x01  // result is negative (bit 7 is set)
         00022$:
@@ -418,11 +858,11 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             sub a, #MIDDLE_SVM_TABLE
             neg a
             ld  xl, a
-            ld  a, _ui8_g_duty_cycle+0
+            ld  a, DUTY_CYCLE_SVM_ASM
             mul x, a
             // ui16_a = (uint8_t)(MIDDLE_PWM_COUNTER - (uint8_t) (ui16_a >> 8)) << 1;
             ld  a, xh
-            sub a, #MIDDLE_PWM_COUNTER
+            sub a, MIDDLE_PWM_COUNTER_ASM
             clr _ui16_a+0
             neg a
             jrpl 00023$
@@ -453,12 +893,12 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             // ui16_b = (uint16_t)((uint8_t)(ui8_temp - MIDDLE_SVM_TABLE) * (uint8_t)ui8_g_duty_cycle);
             sub a, #MIDDLE_SVM_TABLE
             ld  xl, a
-            ld  a, _ui8_g_duty_cycle+0
+            ld  a, DUTY_CYCLE_SVM_ASM
             mul x, a
             // ui16_b = (uint8_t)(MIDDLE_PWM_COUNTER + (uint8_t)(ui16_b >> 8)) << 1;
             ld  a, xh
             clr _ui16_b+0
-            add a, #MIDDLE_PWM_COUNTER
+            add a, MIDDLE_PWM_COUNTER_ASM
             jrpl 00026$
             mov _ui16_b+0, #0x01
         00026$:
@@ -470,11 +910,11 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             sub a, #MIDDLE_SVM_TABLE
             neg a
             ld  xl, a
-            ld  a, _ui8_g_duty_cycle+0
+            ld  a, DUTY_CYCLE_SVM_ASM
             mul x, a
             // ui16_b = (uint8_t)(MIDDLE_PWM_COUNTER - (uint8_t) (ui16_b >> 8)) << 1;
             ld  a, xh
-            sub a, #MIDDLE_PWM_COUNTER
+            sub a, MIDDLE_PWM_COUNTER_ASM
             clr _ui16_b+0
             neg a
             jrpl 00027$
@@ -506,12 +946,12 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             // ui16_c = (uint16_t)((uint8_t)(ui8_temp - MIDDLE_SVM_TABLE) * (uint8_t)ui8_g_duty_cycle);
             sub a, #MIDDLE_SVM_TABLE
             ld  xl, a
-            ld  a, _ui8_g_duty_cycle+0
+            ld  a, DUTY_CYCLE_SVM_ASM
             mul x, a
             // ui16_c = (uint8_t)(MIDDLE_PWM_COUNTER + (uint8_t)(ui16_c >> 8)) << 1;
             ld  a, xh
             clr _ui16_c+0
-            add a, #MIDDLE_PWM_COUNTER
+            add a, MIDDLE_PWM_COUNTER_ASM
             jrpl 00030$
             mov _ui16_c+0, #0x01
         00030$:
@@ -523,11 +963,11 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             sub a, #MIDDLE_SVM_TABLE
             neg a
             ld  xl, a
-            ld  a, _ui8_g_duty_cycle+0
+            ld  a, DUTY_CYCLE_SVM_ASM
             mul x, a
             // ui16_c = (uint8_t)(MIDDLE_PWM_COUNTER - (uint8_t) (ui16_c >> 8)) << 1;
             ld  a, xh
-            sub a, #MIDDLE_PWM_COUNTER
+            sub a, MIDDLE_PWM_COUNTER_ASM
             clr _ui16_c+0
             neg a
             jrpl 00031$
@@ -539,6 +979,29 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         __endasm;
         #endif
 
+    hall_state_invalid:
+    #ifdef SINGLE_SHUNT_FOC
+        // q axis reference of the current loop
+        ui8_shunt_angle = ui8_temp - ui8_g_foc_angle;
+
+        if (ui8_shunt_period == SHUNT_SAMPLE_PERIOD) {
+            // first sample (+I of the highest duty cycle phase), conversion started with this interrupt
+            while (!(ADC1->CSR & ADC1_CSR_EOC))
+                ;
+            ui16_shunt_sample_1 = ADC1->DRL;
+            if (ADC1->DRH)
+                ui16_shunt_sample_1 = 255;
+            // clear EOC flag (channel 5 selected)
+            ADC1->CSR = 0x05;
+            // move the ADC trigger to the second sampling point (up counting)
+            // OC4REF is high now: force it active while changing CCR4 to avoid a rising edge on TRGO
+            TIM1->CCMR4 = TIM1_FORCEDACTION_ACTIVE;
+            TIM1->CCR4H = (uint8_t)(ui16_shunt_p2 >> 8);
+            TIM1->CCR4L = (uint8_t)(ui16_shunt_p2);
+            TIM1->CCMR4 = TIM1_OCMODE_PWM2;
+        }
+    #endif
+
     #ifdef PWM_TIME_DEBUG
         #ifndef __CDT_PARSER__ // avoid Eclipse syntax check
         __asm
@@ -551,7 +1014,27 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         #endif
     #endif
 
+    #ifndef SINGLE_SHUNT_FOC // OC4 is at the middle of the PWM period only without single shunt
+        // execution time from the OC4 match (counting down from the middle value)
+        ui16_pwm_irq_time = (uint16_t)TIM1->CNTRH << 8;
+        ui16_pwm_irq_time |= TIM1->CNTRL;
+        if (TIM1->CR1 & TIM1_CR1_DIR)
+            ui16_pwm_irq_time = (PWM_COUNTER_MAX_IRQ >> 1) - ui16_pwm_irq_time;
+        else
+            ui16_pwm_irq_time += (PWM_COUNTER_MAX_IRQ >> 1); // counting up after the bottom
+        if (ui16_pwm_irq_time > ui16_pwm_irq_down_time_max)
+            ui16_pwm_irq_down_time_max = ui16_pwm_irq_time;
+        #ifndef PWM_SINGLE_IRQ
+        ui16_pwm_irq_load_time_acc += ui16_pwm_irq_time >> 4;
+        #endif
+    #endif
+
+    #ifdef PWM_SINGLE_IRQ
+    }
+    {
+    #else
     } else {
+    #endif
         // CRITICAL SECTION !
         // Disable GPIO Hall interrupt during PWM counter update
         // The whole update is completed in 9 CPU cycles
@@ -569,6 +1052,7 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         */
         #ifndef __CDT_PARSER__ // avoid Eclipse syntax check
         __asm
+        mov _ui8_pwm_irq_sim_start+0, 0x525f // TIM1->CNTRL
         push cc             // save current Interrupt Mask (I1,I0 bits of CC register)
         sim                 // disable interrupts  (set I0,I1 bits of CC register to 1,1)
                             // Hall GPIO interrupt is buffered during this interval
@@ -582,6 +1066,109 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
                          // Hall GPIO buffered interrupt could fire now
         __endasm;
         #endif
+        #ifdef PWM_SINGLE_IRQ
+        // interrupts disabled window, TIM1 counting down
+        ui8_pwm_irq_sim_time = ui8_pwm_irq_sim_start - TIM1->CNTRL;
+        #else
+        // interrupts disabled window, TIM1 counting up
+        ui8_pwm_irq_sim_time = TIM1->CNTRL - ui8_pwm_irq_sim_start;
+        #endif
+        if (ui8_pwm_irq_sim_time > ui8_pwm_irq_sim_time_max)
+            ui8_pwm_irq_sim_time_max = ui8_pwm_irq_sim_time;
+
+        #ifdef PWM_FREQUENCY_SELECT
+        // PWM frequency switch: the compare values just written are calculated for the new middle value.
+        // The counter is counting up just after the middle value (up interrupt, no PWM_SINGLE_IRQ, see main.h):
+        // the new period starts from this cycle top (ARR not preloaded), OC4 (interrupt and ADC trigger) is
+        // preloaded and moves to the new middle at the next update event.
+        if (ui8_pwm_frequency_switch) {
+            ui16_pwm_counter_max = m_pwm_frequency_table[ui8_pwm_frequency_index].ui16_counter_max;
+            TIM1->ARRH = (uint8_t)(ui16_pwm_counter_max >> 8);
+            TIM1->ARRL = (uint8_t)(ui16_pwm_counter_max);
+            TIM1->CCR4H = (uint8_t)((ui16_pwm_counter_max >> 1) >> 8);
+            TIM1->CCR4L = (uint8_t)(ui16_pwm_counter_max >> 1);
+            ui8_pwm_frequency_switch = 0;
+        }
+        #endif
+
+        #ifdef SINGLE_SHUNT_FOC
+        if (ui8_shunt_period == SHUNT_SAMPLE_PERIOD) {
+            // second sample (-I of the lowest duty cycle phase), conversion started with this interrupt
+            while (!(ADC1->CSR & ADC1_CSR_EOC))
+                ;
+            ui16_shunt_sample_min = ADC1->DRL;
+            if (ADC1->DRH)
+                ui16_shunt_sample_min = 255;
+            ui16_shunt_sample_max = ui16_shunt_sample_1;
+            ui8_shunt_sample_pair_order = ui8_shunt_sample_order;
+            ui8_shunt_sample_pair_angle = ui8_shunt_sample_angle;
+            ui8_shunt_new_sample = 1;
+
+            // back to the ADC scan of all channels in the middle of the down counting
+            ADC1->CSR = 0x07;
+            ADC1->CR2 |= ADC1_CR2_SCAN;
+            // OC4REF is high now: force it active while changing CCR4 to avoid a rising edge on TRGO
+            TIM1->CCMR4 = TIM1_FORCEDACTION_ACTIVE;
+            TIM1->CCR4H = (uint8_t)((PWM_COUNTER_MAX/2) >> 8);
+            TIM1->CCR4L = (uint8_t)(PWM_COUNTER_MAX/2);
+            TIM1->CCMR4 = TIM1_OCMODE_PWM1;
+            ui8_shunt_period = SHUNT_SCAN_PERIOD;
+        } else {
+            // sort the phase compare values just applied. Center aligned PWM1 mode:
+            // - between the highest and the middle value only one high side is on -> shunt = +I(max)
+            // - between the middle and the lowest value two high sides are on -> shunt = -I(min)
+            if (ui16_a >= ui16_b) {
+                if (ui16_b >= ui16_c) {
+                    ui16_shunt_max = ui16_a; ui16_shunt_mid = ui16_b; ui16_shunt_min = ui16_c; ui8_shunt_order = 0x02;
+                } else if (ui16_a >= ui16_c) {
+                    ui16_shunt_max = ui16_a; ui16_shunt_mid = ui16_c; ui16_shunt_min = ui16_b; ui8_shunt_order = 0x01;
+                } else {
+                    ui16_shunt_max = ui16_c; ui16_shunt_mid = ui16_a; ui16_shunt_min = ui16_b; ui8_shunt_order = 0x21;
+                }
+            } else {
+                if (ui16_a >= ui16_c) {
+                    ui16_shunt_max = ui16_b; ui16_shunt_mid = ui16_a; ui16_shunt_min = ui16_c; ui8_shunt_order = 0x12;
+                } else if (ui16_b >= ui16_c) {
+                    ui16_shunt_max = ui16_b; ui16_shunt_mid = ui16_c; ui16_shunt_min = ui16_a; ui8_shunt_order = 0x10;
+                } else {
+                    ui16_shunt_max = ui16_c; ui16_shunt_mid = ui16_b; ui16_shunt_min = ui16_a; ui8_shunt_order = 0x20;
+                }
+            }
+
+            // both windows must be longer than dead time + settling time and the down irq
+            // must be ended before the second sampling point
+            if (((ui16_shunt_max - ui16_shunt_mid) >= SINGLE_SHUNT_WINDOW_MIN)
+                    && ((ui16_shunt_mid - ui16_shunt_min) >= SINGLE_SHUNT_WINDOW_MIN)
+                    && ((ui16_shunt_mid << 1) >= SINGLE_SHUNT_IRQ_SPACING_MIN)) {
+                // sample at the end of the windows
+                ui16_shunt_p1 = ui16_shunt_mid + SINGLE_SHUNT_SAMPLE_MARGIN;
+                ui16_shunt_p2 = ui16_shunt_mid - SINGLE_SHUNT_SAMPLE_MARGIN;
+                ui8_shunt_sample_order = ui8_shunt_order;
+                ui8_shunt_sample_angle = ui8_shunt_angle;
+
+                // single conversion of channel 5 (battery current shunt), clear EOC flag
+                ADC1->CR2 &= (uint8_t)~ADC1_CR2_SCAN;
+                ADC1->CSR = 0x05;
+                // ADC trigger and next interrupt at the first sampling point (down counting)
+                // OC4REF is low now: force it inactive while changing CCR4
+                TIM1->CCMR4 = TIM1_FORCEDACTION_INACTIVE;
+                TIM1->CCR4H = (uint8_t)(ui16_shunt_p1 >> 8);
+                TIM1->CCR4L = (uint8_t)(ui16_shunt_p1);
+                TIM1->CCMR4 = TIM1_OCMODE_PWM1;
+                ui8_shunt_period = SHUNT_SAMPLE_PERIOD;
+            } else {
+                // clear EOC flag (and select channel 7)
+                ADC1->CSR = 0x07;
+            }
+        }
+        #endif
+
+        #ifdef PWM_SINGLE_IRQ
+        // the ADC scan started at the OC4 match may not be ended yet (8 channels: 21us): the part of
+        // the scan not covered by the angle calculation is spent here and counted in the CPU load
+        while (!(ADC1->CSR & ADC1_CSR_EOC))
+            ;
+        #endif
 
 
         /****************************************************************************/
@@ -593,6 +1180,9 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         ui16_adc_torque   = (*(uint16_t*)(0x53E8))
         ui16_adc_throttle = (*(uint16_t*)(0x53EE))
         ui8_temp = ADC1->DB5RL
+        ui8_adc_battery_current_raw = ui8_temp;
+        if (ADC1->DB5RH) // read after DB5RL, saturate the peak limit sample
+            ui8_adc_battery_current_raw = 255;
         ui8_adc_battery_current_acc >>= 1;
         ui8_adc_battery_current_filtered >>= 1;
         ui8_adc_battery_current_acc = (uint8_t)(ui8_temp >> 1) + ui8_adc_battery_current_acc;
@@ -632,6 +1222,11 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         ldw x, 0x53EE
         ldw _ui16_adc_throttle, x
         ld  a, 0x53EB                               // ui8_temp |= ADC1->DB5RL;
+        ld  _ui8_adc_battery_current_raw+0, a       // ui8_adc_battery_current_raw = ui8_temp;
+        tnz 0x53EA                                  // if (ADC1->DB5RH)
+        jreq 00050$
+        mov _ui8_adc_battery_current_raw+0, #0xff   // ui8_adc_battery_current_raw = 255;
+    00050$:
         srl _ui8_adc_battery_current_acc+0          // ui8_adc_battery_current_acc >>= 1;
         srl a                                       // ui8_adc_battery_current_acc = (uint8_t)(ui8_temp >> 1) + ui8_adc_battery_current_acc;
         add a, _ui8_adc_battery_current_acc+0
@@ -640,7 +1235,9 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         srl a                                       // ui8_adc_battery_current_filtered = (uint8_t)(ui8_adc_battery_current_acc >> 1) + ui8_adc_battery_current_filtered;
         add a, _ui8_adc_battery_current_filtered+0
         ld  _ui8_adc_battery_current_filtered+0, a
+#ifndef SINGLE_SHUNT_FOC
         mov 0x5400+0, #0x07                         // ADC1->CSR = 0x07;
+#endif
 
         tnz _ui8_g_duty_cycle+0                     // if (ui8_g_duty_cycle > 0)
         jreq 00051$
@@ -695,6 +1292,22 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         __endasm;
         #endif
 
+        /****************************************************************************/
+        // cycle-by-cycle peak current limit: the filtered battery current sees a spike several
+        // PWM cycles late, the raw sample cuts the duty cycle proportionally to the excess current
+        if (ui8_adc_battery_current_raw > ADC_10_BIT_BATTERY_CURRENT_PEAK) {
+            ui8_temp = (uint8_t)((uint16_t)((uint8_t)(ui8_adc_battery_current_raw - ADC_10_BIT_BATTERY_CURRENT_PEAK)
+                    * ui8_g_duty_cycle) >> BATTERY_CURRENT_PEAK_DUTY_CYCLE_SHIFT) + 1;
+            if (ui8_g_duty_cycle > ui8_temp)
+                ui8_g_duty_cycle -= ui8_temp;
+            else
+                ui8_g_duty_cycle = 0;
+            ui8_counter_duty_cycle_ramp_up = 0;
+            if (ui8_battery_current_peak_counter < 255)
+                ui8_battery_current_peak_counter++;
+        }
+
+
         /****************************************************************************/
         // brake state (used also in ebike_app loop)
         // - check if coaster brake is engaged
@@ -710,6 +1323,41 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         }
 
 
+        /****************************************************************************/
+        // fast motor stall detection: rotor stopped (no forward Hall transition, counter reset by the down irq)
+        // with high phase current, duty cycle cut and motor blocked error set by ebike_app
+        if (ui16_motor_stall_hall_cycles <= MOTOR_STALL_HALL_PWM_CYCLES_IRQ)
+            ui16_motor_stall_hall_cycles++;
+        if ((ui16_motor_stall_hall_cycles > MOTOR_STALL_HALL_PWM_CYCLES_IRQ)
+                && (ui8_adc_motor_phase_current > MOTOR_STALL_ADC_PHASE_CURRENT)) {
+            if (++ui8_motor_stall_counter > MOTOR_STALL_PWM_CYCLES_IRQ) {
+                ui8_motor_stall_counter = 0;
+                ui8_g_motor_stalled = 1;
+                ui8_g_duty_cycle = 0;
+            }
+        } else {
+            ui8_motor_stall_counter = 0;
+        }
+
+
+        /****************************************************************************/
+        // controller targets slew between the 30ms updates of ebike_control_motor()
+        if (++ui8_counter_adc_battery_current_slew > ui8_controller_adc_battery_current_slew_inverse_step) {
+            ui8_counter_adc_battery_current_slew = 0;
+            if (ui8_controller_adc_battery_current_target < ui8_controller_adc_battery_current_target_set)
+                ui8_controller_adc_battery_current_target++;
+            else if (ui8_controller_adc_battery_current_target > ui8_controller_adc_battery_current_target_set)
+                ui8_controller_adc_battery_current_target--;
+        }
+        if (++ui8_counter_duty_cycle_slew > ui8_controller_duty_cycle_slew_inverse_step) {
+            ui8_counter_duty_cycle_slew = 0;
+            if (ui8_controller_duty_cycle_target < ui8_controller_duty_cycle_target_set)
+                ui8_controller_duty_cycle_target++;
+            else if (ui8_controller_duty_cycle_target > ui8_controller_duty_cycle_target_set)
+                ui8_controller_duty_cycle_target--;
+        }
+
+
         /****************************************************************************/
         // PWM duty_cycle controller:
         // - limit battery undervolt
@@ -722,9 +1370,13 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
         if ((ui8_g_duty_cycle > ui8_controller_duty_cycle_target)
                 || (ui8_adc_battery_current_filtered > ui8_controller_adc_battery_current_target)
                 || (ui8_adc_motor_phase_current > ADC_10_BIT_MOTOR_PHASE_CURRENT_MAX)
-                || (ui16_hall_counter_total < (HALL_COUNTER_FREQ / MOTOR_OVER_SPEED_ERPS))
+                #ifdef SINGLE_SHUNT_FOC
+                || (ui8_foc_iq > ADC_10_BIT_MOTOR_PHASE_CURRENT_MAX)
+                #endif
+                || (ui16_hall_counter_total < HALL_COUNTER_TOTAL_MIN_IRQ)
                 || (ui16_adc_voltage < ui16_adc_voltage_cut_off)
-                || (ui8_brake_state)) {
+                || (ui8_brake_state)
+                || (ui8_g_motor_stalled)) {
             // reset duty cycle ramp up counter (filter)
             ui8_counter_duty_cycle_ramp_up = 0;
 
@@ -753,12 +1405,12 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
                 ui8_counter_duty_cycle_ramp_up = 0;
 
                 // increment duty cycle
-                if (ui8_g_duty_cycle < PWM_DUTY_CYCLE_MAX) {
+                if (ui8_g_duty_cycle < PWM_DUTY_CYCLE_MAX_IRQ) {
                     ui8_g_duty_cycle++;
                 }
             }
 
-        } else if ((ui8_g_duty_cycle == PWM_DUTY_CYCLE_MAX) && (ui8_g_field_weakening_enable)
+        } else if ((ui8_g_duty_cycle == PWM_DUTY_CYCLE_MAX_IRQ) && (ui8_g_field_weakening_enable)
                 && (ui8_adc_battery_current_filtered < ui8_controller_adc_battery_current_target)) {
             // reset duty cycle ramp down counter (filter)
             ui8_counter_duty_cycle_ramp_down = 0;
@@ -777,130 +1429,6 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             ui8_counter_duty_cycle_ramp_down = 0;
         }
 
-        /****************************************************************************/
-        // Wheel speed sensor detection
-
-        static uint16_t ui16_wheel_speed_sensor_ticks_counter;
-        static uint8_t ui8_wheel_speed_sensor_ticks_counter_started;
-        static uint8_t ui8_wheel_speed_sensor_pin_state_old;
-
-        // check wheel speed sensor pin state
-        uint8_t ui8_wheel_speed_sensor_pin_state = WHEEL_SPEED_SENSOR__PORT->IDR & WHEEL_SPEED_SENSOR__PIN;
-		
-		// check wheel speed sensor ticks counter min value
-		if(ui16_wheel_speed_sensor_ticks) { ui16_wheel_speed_sensor_ticks_counter_min = ui16_wheel_speed_sensor_ticks >> 3; }
-		else { ui16_wheel_speed_sensor_ticks_counter_min = WHEEL_SPEED_SENSOR_TICKS_COUNTER_MIN >> 3; }
-
-		if(!ui8_wheel_speed_sensor_ticks_counter_started ||
-		  (ui16_wheel_speed_sensor_ticks_counter > ui16_wheel_speed_sensor_ticks_counter_min)) {  
-			// check if wheel speed sensor pin state has changed
-			if (ui8_wheel_speed_sensor_pin_state != ui8_wheel_speed_sensor_pin_state_old) {
-				// update old wheel speed sensor pin state
-				ui8_wheel_speed_sensor_pin_state_old = ui8_wheel_speed_sensor_pin_state;
-
-				// only consider the 0 -> 1 transition
-				if (ui8_wheel_speed_sensor_pin_state) {
-					// check if first transition
-					if (!ui8_wheel_speed_sensor_ticks_counter_started) {
-						// start wheel speed sensor ticks counter as this is the first transition
-						ui8_wheel_speed_sensor_ticks_counter_started = 1;
-					} else {
-						// check if wheel speed sensor ticks counter is out of bounds
-						if (ui16_wheel_speed_sensor_ticks_counter < WHEEL_SPEED_SENSOR_TICKS_COUNTER_MAX) {
-							ui16_wheel_speed_sensor_ticks = 0;
-							ui16_wheel_speed_sensor_ticks_counter = 0;
-							ui8_wheel_speed_sensor_ticks_counter_started = 0;
-						} else {
-							ui16_wheel_speed_sensor_ticks = ui16_wheel_speed_sensor_ticks_counter;
-							ui16_wheel_speed_sensor_ticks_counter = 0;
-							++ui32_wheel_speed_sensor_ticks_total;
-						}
-					}
-				}
-			}
-		}
-		
-        // increment and also limit the ticks counter
-        if (ui8_wheel_speed_sensor_ticks_counter_started)
-            if (ui16_wheel_speed_sensor_ticks_counter < WHEEL_SPEED_SENSOR_TICKS_COUNTER_MIN) {
-                ++ui16_wheel_speed_sensor_ticks_counter;
-            } else {
-                // reset variables
-                ui16_wheel_speed_sensor_ticks = 0;
-                ui16_wheel_speed_sensor_ticks_counter = 0;
-                ui8_wheel_speed_sensor_ticks_counter_started = 0;
-            }
-
-
-        /****************************************************************************/
-        /*
-         * - New pedal start/stop detection Algorithm (by MSpider65) -
-         *
-         * Pedal start/stop detection uses both transitions of both PAS sensors
-         * ui8_temp stores the PAS1 and PAS2 state: bit0=PAS1,  bit1=PAS2
-         * Pedal forward ui8_temp sequence is: 0x01 -> 0x00 -> 0x02 -> 0x03 -> 0x01
-         * After a stop, the first forward transition is taken as reference transition
-         * Following forward transition sets the cadence to 7RPM for immediate startup
-         * Then, starting form the second reference transition, the cadence is calculated based on counter value
-         * All transitions resets the stop detection counter (much faster stop detection):
-         */
-        ui8_temp = 0;
-        if (PAS1__PORT->IDR & PAS1__PIN)
-            ui8_temp |= (unsigned char)0x01;
-        if (PAS2__PORT->IDR & PAS2__PIN)
-            ui8_temp |= (unsigned char)0x02;
-
-        if (ui8_temp != ui8_pas_state_old) {
-            if (ui8_pas_state_old != ui8_pas_old_valid_state[ui8_temp]) {
-                // wrong state sequence: backward rotation
-                ui16_cadence_sensor_ticks = 0;
-                ui8_cadence_calc_ref_state = NO_PAS_REF;
-                goto skip_cadence;
-            }
-
-            // pull in counter value from speed
-			ui16_cadence_sensor_ticks_counter_min = ui16_cadence_ticks_count_min_speed_adj;
-
-            // flag transtion
-            ui8_pas_new_transition = 1;
-
-            // Reference state for crank revolution counter increment
-            if (ui8_temp == 0)
-                ui32_crank_revolutions_x20++;
-
-            if (ui8_temp == ui8_cadence_calc_ref_state) {
-                // ui16_cadence_calc_counter is valid for cadence calculation
-                ui16_cadence_sensor_ticks = ui16_cadence_calc_counter;
-                ui16_cadence_calc_counter = 0;
-                // software based Schmitt trigger to stop motor jitter when at resolution limits
-                ui16_cadence_sensor_ticks_counter_min += CADENCE_SENSOR_STANDARD_MODE_SCHMITT_TRIGGER_THRESHOLD;
-                ui8_pas_new_transition = 0x80;
-            } else if (ui8_cadence_calc_ref_state == NO_PAS_REF) {
-                // this is the new reference state for cadence calculation
-                ui8_cadence_calc_ref_state = ui8_temp;
-                ui16_cadence_calc_counter = 0;
-            } else if (ui16_cadence_sensor_ticks == 0) {
-                // Waiting the second reference transition: set the cadence to 7 RPM for immediate start
-                ui16_cadence_sensor_ticks = CADENCE_TICKS_STARTUP;
-            }
-
-            skip_cadence:
-            // reset the counter used to detect pedal stop
-            ui16_cadence_stop_counter = 0;
-            // save current PAS state
-            ui8_pas_state_old = ui8_temp;
-        }
-
-        if (++ui16_cadence_stop_counter > ui16_cadence_sensor_ticks_counter_min) {
-            // pedals stop detected
-            ui16_cadence_sensor_ticks = 0;
-            ui16_cadence_stop_counter = 0;
-            ui8_cadence_calc_ref_state = NO_PAS_REF;
-        } else if (ui8_cadence_calc_ref_state != NO_PAS_REF) {
-            // increment cadence tick counter
-            ++ui16_cadence_calc_counter;
-        }
-
         #ifdef MAIN_TIME_DEBUG
             ui8_main_time++;
         #endif
@@ -916,12 +1444,59 @@ void TIM1_CAP_COM_IRQHandler(void) __interrupt(TIM1_CAP_COM_IRQHANDLER)
             __endasm;
             #endif
         #endif
+
+        #ifndef SINGLE_SHUNT_FOC
+        ui16_pwm_irq_time = (uint16_t)TIM1->CNTRH << 8;
+        ui16_pwm_irq_time |= TIM1->CNTRL;
+        #ifdef PWM_SINGLE_IRQ
+        // execution time of the whole interrupt from the OC4 match (counting down from the middle value)
+        if (TIM1->CR1 & TIM1_CR1_DIR)
+            ui16_pwm_irq_time = (PWM_COUNTER_MAX_IRQ >> 1) - ui16_pwm_irq_time;
+        else
+            ui16_pwm_irq_time += (PWM_COUNTER_MAX_IRQ >> 1); // counting up after the bottom
+        #else
+        // execution time from the OC4 match (counting up from the middle value)
+        if (TIM1->CR1 & TIM1_CR1_DIR)
+            ui16_pwm_irq_time = (PWM_COUNTER_MAX_IRQ << 1) - (PWM_COUNTER_MAX_IRQ >> 1) - ui16_pwm_irq_time; // counting down after the top
+        else
+            ui16_pwm_irq_time -= (PWM_COUNTER_MAX_IRQ >> 1);
+        #endif
+        if (ui16_pwm_irq_time > ui16_pwm_irq_up_time_max)
+            ui16_pwm_irq_up_time_max = ui16_pwm_irq_time;
+
+        // CPU load of this interrupt: execution time and period (TIM1 counts / 16) of the last 256 PWM cycles
+        ui16_pwm_irq_load_time_acc += ui16_pwm_irq_time >> 4;
+        ui16_pwm_irq_load_period_acc += PWM_COUNTER_MAX_IRQ >> 3;
+        if (++ui8_pwm_irq_load_cycles == 0) {
+            ui16_pwm_irq_load_time = ui16_pwm_irq_load_time_acc;
+            ui16_pwm_irq_load_period = ui16_pwm_irq_load_period_acc;
+            ui16_pwm_irq_load_time_acc = 0;
+            ui16_pwm_irq_load_period_acc = 0;
+        }
+        #endif
     }
 
     /****************************************************************************/
     irq_end:
-    // clears the TIM1 interrupt TIM1_IT_UPDATE pending bit
-    TIM1->SR1 = (uint8_t) (~(uint8_t) TIM1_IT_CC4);
+    // OC4 matched again during this interrupt: count the overrun and clear the pending bit as before
+    if (TIM1->SR1 & TIM1_SR1_CC4IF) {
+        ui16_pwm_irq_overrun_counter++;
+        TIM1->SR1 = (uint8_t) (~(uint8_t) TIM1_IT_CC4);
+    }
+}
+
+// TIM1 break interrupt: hardware over current on TIM1_BKIN (PD0).
+// MOE is already cleared by hardware (all outputs off), only latch the event here.
+void TIM1_BRK_IRQHandler(void) __interrupt(TIM1_OVF_IRQHANDLER)
+{
+    ui8_g_duty_cycle = 0;
+    ui8_g_hardware_overcurrent = 1;
+    if (ui8_hardware_overcurrent_counter < 255) {
+        ui8_hardware_overcurrent_counter++;
+    }
+    // break input is level sensitive: disable the interrupt until recovery
+    TIM1->IER &= (uint8_t)~TIM1_IER_BIE;
+    TIM1->SR1 = (uint8_t)~TIM1_SR1_BIF;
 }
 
 void hall_sensor_init(void) {
@@ -930,6 +1505,32 @@ void hall_sensor_init(void) {
     GPIO_Init(HALL_SENSOR_B__PORT, (GPIO_Pin_TypeDef) HALL_SENSOR_B__PIN, GPIO_MODE_IN_FL_IT);
     GPIO_Init(HALL_SENSOR_C__PORT, (GPIO_Pin_TypeDef) HALL_SENSOR_C__PIN, GPIO_MODE_IN_FL_IT);
 
+    // page zero variables (not initialized by the startup code)
+    ui16_a = 0;
+    ui16_b = 0;
+    ui16_c = 0;
+    ui8_temp = 0;
+    ui8_g_duty_cycle = 0;
+    ui16_hall_counter_total = 0xffff;
+    ui8_hall_60_ref_irq[0] = 0;
+    ui8_hall_60_ref_irq[1] = 0;
+    ui16_hall_60_ref_old = 0;
+    ui8_hall_counter_offset = 0;
+    ui8_fw_hall_counter_offset = 0;
+    ui8_motor_phase_absolute_angle = 0;
+    ui8_g_foc_angle = 0;
+    ui8_foc_angle_accumulated = 0;
+    ui8_foc_flag = 0;
+    ui8_adc_battery_current_acc = 0;
+    ui8_adc_battery_current_filtered = 0;
+    ui8_adc_motor_phase_current = 0;
+    ui8_motor_commutation_type = BLOCK_COMMUTATION;
+    ui8_hall_sector_angle = HALL_SECTOR_HALF_ANGLE;
+    #ifdef PWM_FREQUENCY_SELECT
+    ui8_pwm_middle_counter = MIDDLE_PWM_COUNTER;
+    ui8_pwm_duty_cycle = 0;
+    #endif
+
     ui8_hall_state_irq = 0;
     if (HALL_SENSOR_A__PORT->IDR & HALL_SENSOR_A__PIN)
         ui8_hall_state_irq |= (unsigned char)0x01;
@@ -947,27 +1548,147 @@ void hall_sensor_init(void) {
     EXTI_SetExtIntSensitivity(EXTI_PORT_GPIOC, EXTI_SENSITIVITY_RISE_FALL);
     EXTI_SetExtIntSensitivity(EXTI_PORT_GPIOD, EXTI_SENSITIVITY_RISE_FALL);
     EXTI_SetExtIntSensitivity(EXTI_PORT_GPIOE, EXTI_SENSITIVITY_RISE_FALL);
-    EXTI_SetTLISensitivity(EXTI_TLISENSITIVITY_FALL_ONLY);
 }
 
+// Motor launch with rotor stopped: force the down irq to set again rotor angle and Hall counter offset
+// from the current Hall state (reference angles may have been changed while the rotor was stopped)
+// and to restart from block commutation.
+void motor_hall_align(void) {
+    disableInterrupts();
+    ui8_hall_sensors_state_last = 7; // invalid value
+    ui8_hall_60_ref_valid = 0;
+    ui8_hall_360_ref_valid = 0;
+    ui8_hall_counter_total_provisional = 0;
+    ui8_low_speed_ref_valid = 0;
+    ui8_low_speed_valid = 0;
+    ui8_hall_sector_angle = HALL_SECTOR_HALF_ANGLE;
+    ui8_motor_commutation_type = BLOCK_COMMUTATION;
+    ui16_hall_counter_total = 0xffff;
+    ui16_motor_stall_hall_cycles = 0;
+    enableInterrupts();
+}
+
+/*---------------------------------------------------------
+ NOTE: regarding PWM outputs enable/disable
+
+ Only the CCxE and CCxNE bits of channels 1, 2 and 3 are
+ changed: output compare mode, polarity and idle states are
+ configured once in pwm_init() and the duty cycle registers
+ are written by the PWM interrupt every cycle.
+ The MOE bit is not used: with MOE = 0 the outputs go to the
+ idle state (OC and OCN idle state RESET, high and low side
+ off) too, but MOE is left to the break input (hardware over
+ current), cleared by hardware and set again only by
+ motor_break_recovery().
+ Latency: 2 read-modify-write (ld, or/and, ld) of TIM1->CCER1
+ and TIM1->CCER2 plus the flag write, about 15 CPU cycles
+ (< 1us) with call and return, the outputs change at the
+ second write. The three TIM1_OCxInit() calls used before
+ took more than 500 CPU cycles (> 30us).
+ ---------------------------------------------------------*/
+// Called with interrupts disabled: the brake pin interrupt also writes TIM1 CCER1/CCER2
 void motor_enable_pwm(void) {
-    TIM1_OC1Init(TIM1_OCMODE_PWM1, TIM1_OUTPUTSTATE_ENABLE, TIM1_OUTPUTNSTATE_ENABLE, 128, // initial duty_cycle value
-            TIM1_OCPOLARITY_HIGH, TIM1_OCPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCIDLESTATE_SET);
+    TIM1->CCER1 |= (uint8_t)(TIM1_CCER1_CC1E | TIM1_CCER1_CC1NE | TIM1_CCER1_CC2E | TIM1_CCER1_CC2NE);
+    TIM1->CCER2 |= (uint8_t)(TIM1_CCER2_CC3E | TIM1_CCER2_CC3NE);
+    ui8_g_motor_pwm_enabled = 1;
+}
 
-    TIM1_OC2Init(TIM1_OCMODE_PWM1, TIM1_OUTPUTSTATE_ENABLE, TIM1_OUTPUTNSTATE_ENABLE, 128, // initial duty_cycle value
-            TIM1_OCPOLARITY_HIGH, TIM1_OCPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCIDLESTATE_SET);
+void motor_disable_pwm(void) {
+    TIM1->CCER1 &= (uint8_t)~(TIM1_CCER1_CC1E | TIM1_CCER1_CC1NE | TIM1_CCER1_CC2E | TIM1_CCER1_CC2NE);
+    TIM1->CCER2 &= (uint8_t)~(TIM1_CCER2_CC3E | TIM1_CCER2_CC3NE);
+    ui8_g_motor_pwm_enabled = 0;
+}
 
-    TIM1_OC3Init(TIM1_OCMODE_PWM1, TIM1_OUTPUTSTATE_ENABLE, TIM1_OUTPUTNSTATE_ENABLE, 128, // initial duty_cycle value
-            TIM1_OCPOLARITY_HIGH, TIM1_OCPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCIDLESTATE_SET);
+// Re-arm the PWM outputs after a hardware over current break (motor must be disabled and duty cycle 0).
+// Returns 0 if the break input is still active.
+uint8_t motor_break_recovery(void) {
+    TIM1->SR1 = (uint8_t)~TIM1_SR1_BIF;
+    if (TIM1->SR1 & TIM1_SR1_BIF) {
+        return 0;
+    }
+    ui8_g_hardware_overcurrent = 0;
+    TIM1->BKR |= TIM1_BKR_MOE;
+    TIM1->IER |= TIM1_IER_BIE;
+    return 1;
 }
 
-void motor_disable_pwm(void) {
-    TIM1_OC1Init(TIM1_OCMODE_PWM1, TIM1_OUTPUTSTATE_DISABLE, TIM1_OUTPUTNSTATE_DISABLE, 128, // initial duty_cycle value
-            TIM1_OCPOLARITY_HIGH, TIM1_OCPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCIDLESTATE_SET);
+#ifdef SINGLE_SHUNT_FOC
+// sine quarter wave: 64 steps for 90 degrees, amplitude 64
+static const uint8_t ui8_sin_table[65] = { 0, 2, 3, 5, 6, 8, 9, 11, 12, 14, 16, 17, 19, 20, 22, 23, 24, 26, 27, 29,
+        30, 32, 33, 34, 36, 37, 38, 39, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 56, 57, 58, 59,
+        59, 60, 60, 61, 61, 62, 62, 62, 63, 63, 63, 64, 64, 64, 64, 64, 64 };
+
+static int16_t sin_x64(uint8_t ui8_angle) {
+    uint8_t ui8_index = ui8_angle & 0x3f;
 
-    TIM1_OC2Init(TIM1_OCMODE_PWM1, TIM1_OUTPUTSTATE_DISABLE, TIM1_OUTPUTNSTATE_DISABLE, 128, // initial duty_cycle value
-            TIM1_OCPOLARITY_HIGH, TIM1_OCPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCIDLESTATE_SET);
+    if (ui8_angle & 0x40)
+        ui8_index = 64 - ui8_index;
+    if (ui8_angle & 0x80)
+        return -(int16_t)ui8_sin_table[ui8_index];
+    return (int16_t)ui8_sin_table[ui8_index];
+}
+
+static int16_t i16_foc_id_integral_x256 = 0;
+
+// Single shunt current loop, called from the main loop for every new sample pair
+void motor_foc_current_loop(void) {
+    int16_t i16_i_phase[3];
+    int16_t i16_i_alpha, i16_i_beta, i16_sin, i16_cos, i16_id, i16_iq;
+    uint16_t ui16_i_max, ui16_i_min;
+    uint8_t ui8_order, ui8_angle;
+
+    disableInterrupts();
+    ui16_i_max = ui16_shunt_sample_max;
+    ui16_i_min = ui16_shunt_sample_min;
+    ui8_order = ui8_shunt_sample_pair_order;
+    ui8_angle = ui8_shunt_sample_pair_angle;
+    ui8_shunt_new_sample = 0;
+    enableInterrupts();
+
+    if (ui8_motor_commutation_type == BLOCK_COMMUTATION) {
+        // FOC angle is not used without interpolation
+        i16_foc_id_integral_x256 = 0;
+        ui8_foc_iq = 0;
+        return;
+    }
 
-    TIM1_OC3Init(TIM1_OCMODE_PWM1, TIM1_OUTPUTSTATE_DISABLE, TIM1_OUTPUTNSTATE_DISABLE, 128, // initial duty_cycle value
-            TIM1_OCPOLARITY_HIGH, TIM1_OCPOLARITY_HIGH, TIM1_OCIDLESTATE_RESET, TIM1_OCIDLESTATE_SET);
+    // rebuild the three phase currents: I(max) + I(mid) + I(min) = 0
+    i16_i_phase[ui8_order >> 4] = (int16_t)ui16_i_max;
+    i16_i_phase[ui8_order & 0x03] = -(int16_t)ui16_i_min;
+    i16_i_phase[3 - (ui8_order >> 4) - (ui8_order & 0x03)] = (int16_t)ui16_i_min - (int16_t)ui16_i_max;
+
+    // Clarke transform on the SVM table reference: phase B at 0, phase A at +120, phase C at -120 degrees
+    // i_alpha = i_B, i_beta = (i_A - i_C) / sqrt(3)
+    i16_i_alpha = i16_i_phase[1];
+    i16_i_beta = ((i16_i_phase[0] - i16_i_phase[2]) * 37) >> 6;
+
+    // Park transform on the q axis (voltage vector angle without FOC angle)
+    // Id > 0 when the current lags the q axis
+    i16_sin = sin_x64(ui8_angle);
+    i16_cos = sin_x64(ui8_angle + 64);
+    i16_iq = ((i16_i_alpha * i16_cos) >> 6) + ((i16_i_beta * i16_sin) >> 6);
+    i16_id = ((i16_i_alpha * i16_sin) >> 6) - ((i16_i_beta * i16_cos) >> 6);
+
+    if (i16_iq < 0)
+        ui8_foc_iq = 0;
+    else if (i16_iq > 255)
+        ui8_foc_iq = 255;
+    else
+        ui8_foc_iq = (uint8_t)i16_iq;
+
+    // PI: advance the voltage vector until Id = 0
+    i16_foc_id_integral_x256 += i16_id * SINGLE_SHUNT_ID_KI;
+    if (i16_foc_id_integral_x256 < 0)
+        i16_foc_id_integral_x256 = 0;
+    else if (i16_foc_id_integral_x256 > (SINGLE_SHUNT_FOC_ANGLE_MAX << 8))
+        i16_foc_id_integral_x256 = (SINGLE_SHUNT_FOC_ANGLE_MAX << 8);
+
+    i16_id = i16_foc_id_integral_x256 + (i16_id * SINGLE_SHUNT_ID_KP);
+    if (i16_id < 0)
+        i16_id = 0;
+    else if (i16_id > (SINGLE_SHUNT_FOC_ANGLE_MAX << 8))
+        i16_id = (SINGLE_SHUNT_FOC_ANGLE_MAX << 8);
+
+    ui8_g_foc_angle = (uint8_t)(i16_id >> 8);
 }
+#endif
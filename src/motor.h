@@ -10,6 +10,7 @@
 #define _MOTOR_H_
 
 #include <stdint.h>
+#include "main.h"
 
 // motor states
 #define BLOCK_COMMUTATION 			            0
@@ -22,9 +23,21 @@ extern volatile uint16_t ui16_adc_voltage_cut_off;
 extern volatile uint8_t ui8_adc_battery_current_filtered;
 extern volatile uint8_t ui8_controller_adc_battery_current_target;
 extern volatile uint8_t ui8_g_duty_cycle;
+extern volatile uint8_t ui8_g_motor_pwm_enabled;
+extern volatile uint8_t ui8_g_hardware_overcurrent;
+extern volatile uint8_t ui8_hardware_overcurrent_counter;
 extern volatile uint8_t ui8_fw_hall_counter_offset;
 extern volatile uint16_t ui16_hall_counter_total;
 extern volatile uint8_t ui8_controller_duty_cycle_target;
+extern volatile uint8_t ui8_controller_adc_battery_current_target_set;
+extern volatile uint8_t ui8_controller_adc_battery_current_slew_inverse_step;
+extern volatile uint8_t ui8_controller_duty_cycle_target_set;
+extern volatile uint8_t ui8_controller_duty_cycle_slew_inverse_step;
+#ifdef PWM_FREQUENCY_SELECT
+extern volatile uint8_t ui8_pwm_frequency_request;
+extern volatile uint8_t ui8_pwm_frequency_index;
+extern volatile uint8_t ui8_pwm_ramp_scale_x128;
+#endif
 extern volatile uint8_t ui8_g_foc_angle;
 extern volatile uint8_t ui8_g_field_weakening_enable;
 extern volatile uint8_t ui8_hall_sensors_state;
@@ -38,22 +51,31 @@ extern volatile uint16_t ui16_motor_speed_erps;
 
 // sensors
 extern volatile uint8_t ui8_brake_state;
+extern volatile uint8_t ui8_brake_fast_stop_counter;
+extern volatile uint8_t ui8_battery_current_peak_counter;
+extern volatile uint8_t ui8_g_motor_stalled;
+extern volatile uint16_t ui16_pwm_irq_overrun_counter;
+extern volatile uint16_t ui16_pwm_irq_up_time_max;
+extern volatile uint16_t ui16_pwm_irq_down_time_max;
+extern volatile uint16_t ui16_pwm_irq_load_time;
+extern volatile uint16_t ui16_pwm_irq_load_period;
+extern volatile uint8_t ui8_pwm_irq_sim_time_max;
 extern volatile uint16_t ui16_adc_voltage;
 extern volatile uint16_t ui16_adc_torque;
 extern volatile uint16_t ui16_adc_throttle;
 
-// cadence sensor
-extern volatile uint16_t ui16_cadence_sensor_ticks;
-extern volatile uint32_t ui32_crank_revolutions_x20;
-
-// wheel speed sensor
-extern volatile uint16_t ui16_wheel_speed_sensor_ticks;
-extern volatile uint32_t ui32_wheel_speed_sensor_ticks_total;
-
-extern volatile uint8_t ui8_pas_new_transition;
+#ifdef SINGLE_SHUNT_FOC
+extern volatile uint8_t ui8_shunt_new_sample;
+extern volatile uint8_t ui8_foc_iq;
+#endif
 
 void hall_sensor_init(void); // must be called before using the motor
 void motor_enable_pwm(void);
 void motor_disable_pwm(void);
+void motor_hall_align(void);
+uint8_t motor_break_recovery(void);
+#ifdef SINGLE_SHUNT_FOC
+void motor_foc_current_loop(void);
+#endif
 
 #endif /* _MOTOR_H_ */
@@ -13,11 +13,96 @@
 #include "motor.h"
 #include "main.h"
 #include "ebike_app.h"
+#include "pas.h"
+
+#ifdef __CDT_PARSER__
+#define __interrupt(x)  // Disable Eclipse syntax check on interrupt keyword
+#endif
+
+#if PAS_FIFO_SIZE != 8
+#error "PAS_FIFO_SIZE: the FIFO index mask of the PAS interrupts is 0x07"
+#endif
+
+volatile uint8_t ui8_pas1_fifo_write_index = 0;
+volatile uint8_t ui8_pas1_fifo_state[PAS_FIFO_SIZE];
+volatile uint16_t ui16_pas1_fifo_timestamp[PAS_FIFO_SIZE];
+volatile uint8_t ui8_pas2_fifo_write_index = 0;
+volatile uint8_t ui8_pas2_fifo_state[PAS_FIFO_SIZE];
+volatile uint16_t ui16_pas2_fifo_timestamp[PAS_FIFO_SIZE];
+
+volatile uint8_t ui8_pas1_state_irq = 0;
+static uint8_t ui8_pas2_state_irq = 0;
 
 void pas_init(void) {
-    //PAS1 pin as external input pin
-    GPIO_Init(PAS1__PORT, PAS1__PIN, GPIO_MODE_IN_PU_NO_IT); // input pull-up, no external interrupt
+    //PAS1 pin as external input pin interrupt (port E, shared with Hall sensor A)
+    GPIO_Init(PAS1__PORT, PAS1__PIN, GPIO_MODE_IN_PU_IT); // input pull-up, external interrupt
+
+    //PAS2 pin as external input pin interrupt (PD7: TLI)
+    GPIO_Init(PAS2__PORT, PAS2__PIN, GPIO_MODE_IN_PU_IT); // input pull-up, external interrupt
+
+    if (PAS1__PORT->IDR & PAS1__PIN)
+        ui8_pas1_state_irq = 0x01;
+    // TLI single edge: the next PAS2 edge (interrupts still disabled, EXTI_CR2 writable)
+    if (PAS2__PORT->IDR & PAS2__PIN) {
+        ui8_pas2_state_irq = 0x02;
+        EXTI_SetTLISensitivity(EXTI_TLISENSITIVITY_FALL_ONLY);
+    } else {
+        EXTI_SetTLISensitivity(EXTI_TLISENSITIVITY_RISE_ONLY);
+    }
+}
+
+// PAS2 edge: top level interrupt, it can interrupt any routine (Hall and PWM interrupts,
+// critical sections) so it writes only its own FIFO. The sensitivity is toggled to catch
+// the next edge; an edge lost in between is seen as a missing transition by calc_cadence().
+void PAS2_TLI_IRQHandler(void) __interrupt(EXTI_PAS2_IRQ) __naked {
+    /*
+    uint16_t ui16_timestamp = TIM3 counter;
+    uint8_t ui8_state = 0;
 
-    //PAS2 pin as external input pin interrupt
-    GPIO_Init(PAS2__PORT, PAS2__PIN, GPIO_MODE_IN_PU_NO_IT); // input pull-up, no external interrupt
+    if (PAS2__PORT->IDR & PAS2__PIN) {
+        EXTI->CR2 &= (uint8_t)~EXTI_CR2_TLIS; // next edge: falling
+        ui8_state = 0x02;
+    } else {
+        EXTI->CR2 |= EXTI_CR2_TLIS; // next edge: rising
+    }
+    if (ui8_state != ui8_pas2_state_irq) {
+        ui8_pas2_state_irq = ui8_state;
+        if (PAS1__PORT->IDR & PAS1__PIN)
+            ui8_state |= 0x01;
+        ui8_pas2_fifo_state[ui8_pas2_fifo_write_index & (PAS_FIFO_SIZE - 1)] = ui8_state;
+        ui16_pas2_fifo_timestamp[ui8_pas2_fifo_write_index & (PAS_FIFO_SIZE - 1)] = ui16_timestamp;
+        ui8_pas2_fifo_write_index++;
+    }
+    */
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        ldw x, 0x5328                       // TIM3->CNTRH, TIM3->CNTRL
+        btjf 0x5010, #7, 00001$             // PAS2__PORT->IDR (PD7)
+        bres 0x50a1, #2                     // EXTI->CR2 TLIS: next edge falling
+        ld  a, #0x02
+        jra 00002$
+    00001$:
+        bset 0x50a1, #2                     // EXTI->CR2 TLIS: next edge rising
+        clr a
+    00002$:
+        cp  a, _ui8_pas2_state_irq+0
+        jreq 00004$                         // PAS2 not changed
+        ld  _ui8_pas2_state_irq+0, a
+        btjf 0x5015, #0, 00003$             // PAS1__PORT->IDR (PE0)
+        or  a, #0x01
+    00003$:
+        push a
+        ld  a, _ui8_pas2_fifo_write_index+0
+        and a, #0x07                        // PAS_FIFO_SIZE - 1
+        clrw y
+        ld  yl, a
+        pop a
+        ld  (_ui8_pas2_fifo_state, y), a
+        sllw y
+        ldw (_ui16_pas2_fifo_timestamp, y), x
+        inc _ui8_pas2_fifo_write_index+0
+    00004$:
+        iret
+    __endasm;
+    #endif
 }
@@ -11,6 +11,18 @@
 
 #include "main.h"
 
+// PAS edges FIFOs (PAS1: port E interrupt, PAS2: TLI), written only by the interrupts
+// state: bit0 = PAS1, bit1 = PAS2 after the edge, timestamp: TIM3 counter (4us)
+extern volatile uint8_t ui8_pas1_fifo_write_index;
+extern volatile uint8_t ui8_pas1_fifo_state[PAS_FIFO_SIZE];
+extern volatile uint16_t ui16_pas1_fifo_timestamp[PAS_FIFO_SIZE];
+extern volatile uint8_t ui8_pas2_fifo_write_index;
+extern volatile uint8_t ui8_pas2_fifo_state[PAS_FIFO_SIZE];
+extern volatile uint16_t ui16_pas2_fifo_timestamp[PAS_FIFO_SIZE];
+
+// PAS1 level seen by the port E interrupt (bit0)
+extern volatile uint8_t ui8_pas1_state_irq;
+
 void pas_init(void);
 void pas2_init(void);
 
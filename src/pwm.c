@@ -29,15 +29,20 @@ void pwm_init(void) {
     for (ui32_delay_counter = 0; ui32_delay_counter < 160000; ++ui32_delay_counter) {
     }
 
-    if (FLASH_ReadOptionByte(0x4803) != 0x20) {
+    // OPT2: AFR5 (PB0-PB2 = TIM1_CH1N-CH3N) and AFR3 (PD0 = TIM1_BKIN, hardware over current)
+    if (FLASH_ReadOptionByte(0x4803) != 0x28) {
         FLASH_Unlock(FLASH_MEMTYPE_DATA);
         FLASH_EraseOptionByte(0x4803);
-        FLASH_ProgramOptionByte(0x4803, 0x20);
+        FLASH_ProgramOptionByte(0x4803, 0x28);
         FLASH_Lock(FLASH_MEMTYPE_DATA);
     }
 
     TIM1_TimeBaseInit(0, // TIM1_Prescaler = 0
+            #ifdef PWM_SINGLE_IRQ
+            TIM1_COUNTERMODE_CENTERALIGNED1,  // Compare interrupt is fired once (when counter is counting down)
+            #else
             TIM1_COUNTERMODE_CENTERALIGNED3,  // Compare interrupt is fired twice (when counter is counting up and down)
+            #endif
             // clock = 16MHz; counter period = 840; PWM freq = 16MHz / 840 = 19,047kHz;
             PWM_COUNTER_MAX, // PWM center aligned mode: counts from 0 to 420 and then down from 420 to 0
             1);// will fire the TIM1_IT_UPDATE at every PWM period cycle
@@ -51,7 +56,7 @@ void pwm_init(void) {
             TIM1_OCPOLARITY_HIGH,
             TIM1_OCPOLARITY_HIGH,
             TIM1_OCIDLESTATE_RESET,
-            TIM1_OCNIDLESTATE_SET);
+            TIM1_OCNIDLESTATE_RESET);
 
     TIM1_OC2Init(TIM1_OCMODE_PWM1,
             TIM1_OUTPUTSTATE_ENABLE,
@@ -60,7 +65,7 @@ void pwm_init(void) {
             TIM1_OCPOLARITY_HIGH,
             TIM1_OCPOLARITY_HIGH,
             TIM1_OCIDLESTATE_RESET,
-            TIM1_OCIDLESTATE_SET);
+            TIM1_OCNIDLESTATE_RESET);
 
     TIM1_OC3Init(TIM1_OCMODE_PWM1,
             TIM1_OUTPUTSTATE_ENABLE,
@@ -69,7 +74,7 @@ void pwm_init(void) {
             TIM1_OCPOLARITY_HIGH,
             TIM1_OCPOLARITY_HIGH,
             TIM1_OCIDLESTATE_RESET,
-            TIM1_OCNIDLESTATE_SET);
+            TIM1_OCNIDLESTATE_RESET);
 
     // OC4 is being used only to fire interrupt at a specific time (middle of both up/down TIM1 count)
     TIM1_OC4Init(TIM1_OCMODE_PWM1,
@@ -78,12 +83,19 @@ void pwm_init(void) {
             TIM1_OCPOLARITY_HIGH,
             TIM1_OCIDLESTATE_RESET);
 
+    #ifdef PWM_FREQUENCY_SELECT
+    // OC4 middle value changed with the PWM period: preloaded, updated at the update event
+    TIM1_OC4PreloadConfig(ENABLE);
+    #endif
+
     // break, dead time and lock configuration
+    // Break input (PD0 low = hardware over current) clears MOE in hardware: all outputs go to the
+    // idle state (high and low side off). MOE is set again by software, see motor_break_recovery().
     TIM1_BDTRConfig(TIM1_OSSISTATE_ENABLE,
             TIM1_LOCKLEVEL_OFF,
             // hardware nees a dead time of 1us
             32,// DTG = 0; dead time in 62.5 ns steps; 1us/62.5ns = 16
-            TIM1_BREAK_DISABLE,
+            TIM1_BREAK_ENABLE,
             TIM1_BREAKPOLARITY_LOW,
             TIM1_AUTOMATICOUTPUT_DISABLE);
 
@@ -100,6 +112,10 @@ void pwm_init(void) {
     ITC_SetSoftwarePriority(ITC_IRQ_TIM1_CAPCOM, ITC_PRIORITYLEVEL_2);
     // Set TIM1 interrupt on OC4 Compare
     TIM1_ITConfig(TIM1_IT_CC4, ENABLE);
+    // TIM1 break IRQ priority = 2, break interrupt enabled
+    ITC_SetSoftwarePriority(ITC_IRQ_TIM1_OVF, ITC_PRIORITYLEVEL_2);
+    TIM1_ClearFlag(TIM1_FLAG_BREAK);
+    TIM1_ITConfig(TIM1_IT_BREAK, ENABLE);
     // enable TIM1 counter
     TIM1_Cmd(ENABLE);
     TIM1_CtrlPWMOutputs(ENABLE);
@@ -86,9 +86,19 @@ void timer4_init(void) {
 }
 
 // 2ms counter
-void TIM4_IRQHandler(void) __interrupt(TIM4_OVF_IRQHANDLER) {
+// Naked routine: only the registers saved by the interrupt hardware are used
+void TIM4_IRQHandler(void) __interrupt(TIM4_OVF_IRQHANDLER) __naked {
+    /*
     // increment counter for controller loop
     ui8_ebike_controller_counter++;
     // Reset interrupt flag
     TIM4->SR1 = 0;
+    */
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        inc _ui8_ebike_controller_counter+0
+        clr 0x5344                          // TIM4->SR1 = 0;
+        iret
+    __endasm;
+    #endif
 }
\ No newline at end of file
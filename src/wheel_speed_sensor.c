@@ -12,8 +12,157 @@
 #include "main.h"
 #include "interrupts.h"
 #include "motor.h"
+#include "wheel_speed_sensor.h"
+
+#ifdef __CDT_PARSER__
+#define __interrupt(x)  // Disable Eclipse syntax check on interrupt keyword
+#endif
+
+// wheel speed sensor pulse period (WHEEL_SPEED_SENSOR_TICKS_SECOND units, 0 = wheel stopped) and wheel revolutions
+volatile uint16_t ui16_wheel_speed_sensor_ticks = 0;
+volatile uint32_t ui32_wheel_speed_sensor_ticks_total = 0;
+
+// pulses per wheel revolution and the period limits scaled to one pulse
+static uint8_t ui8_wheel_speed_sensor_pulses = 1;
+static uint8_t ui8_wheel_speed_sensor_pulses_counter = 0;
+static uint16_t ui16_wheel_speed_sensor_ticks_counter_max = WHEEL_SPEED_SENSOR_TICKS_COUNTER_MAX;
+static uint16_t ui16_wheel_speed_sensor_ticks_counter_min = WHEEL_SPEED_SENSOR_TICKS_COUNTER_MIN;
+static uint8_t ui8_wheel_speed_sensor_wraps_max = WHEEL_SPEED_SENSOR_WRAPS_MAX;
+
+// Hall counter (TIM3) value of the last valid wheel speed sensor rising edge and TIM3 wraps since then
+static uint16_t ui16_wheel_speed_sensor_timestamp;
+static uint16_t ui16_wheel_speed_sensor_timestamp_old;
+static uint16_t ui16_wheel_speed_sensor_now;
+static uint8_t ui8_wheel_speed_sensor_wraps = 0;
+static uint8_t ui8_wheel_speed_sensor_ticks_counter_started = 0;
 
 void wheel_speed_sensor_init(void) {
-    //wheel speed sensor pin as input pull-up, no external interrupt
-    GPIO_Init(WHEEL_SPEED_SENSOR__PORT, WHEEL_SPEED_SENSOR__PIN, GPIO_MODE_IN_PU_NO_IT);
+    //wheel speed sensor pin as input pull-up, external interrupt on the rising edge
+    GPIO_Init(WHEEL_SPEED_SENSOR__PORT, WHEEL_SPEED_SENSOR__PIN, GPIO_MODE_IN_PU_IT);
+    EXTI_SetExtIntSensitivity(EXTI_PORT_GPIOA, EXTI_SENSITIVITY_RISE_ONLY);
+    // lowest priority, same level of the TIM3 overflow interrupt (not nested)
+    ITC_SetSoftwarePriority(EXTI_WHEEL_SPEED_SENSOR_IRQ, ITC_PRIORITYLEVEL_1);
+
+    // TIM3 (Hall counter, free running) overflow extends the wheel speed sensor timestamps
+    ITC_SetSoftwarePriority(TIM3_OVF_IRQHANDLER, ITC_PRIORITYLEVEL_1);
+    TIM3->SR1 = (uint8_t)~TIM3_SR1_UIF;
+    TIM3_ITConfig(TIM3_IT_UPDATE, ENABLE);
+}
+
+// Magnets evenly spaced on the wheel: the limits of one revolution are divided by the number of pulses
+// (ui8_pulses from 1 to WHEEL_SPEED_SENSOR_PULSES_MAX)
+void wheel_speed_sensor_set_pulses(uint8_t ui8_pulses) {
+    disableInterrupts();
+    ui8_wheel_speed_sensor_pulses = ui8_pulses;
+    ui8_wheel_speed_sensor_pulses_counter = 0;
+    ui16_wheel_speed_sensor_ticks_counter_max = WHEEL_SPEED_SENSOR_TICKS_COUNTER_MAX / ui8_pulses;
+    ui16_wheel_speed_sensor_ticks_counter_min = WHEEL_SPEED_SENSOR_TICKS_COUNTER_MIN / ui8_pulses;
+    ui8_wheel_speed_sensor_wraps_max = WHEEL_SPEED_SENSOR_WRAPS_MAX / ui8_pulses;
+    if (ui8_wheel_speed_sensor_wraps_max == 0)
+        ui8_wheel_speed_sensor_wraps_max = 1;
+    // restart the measurement
+    ui16_wheel_speed_sensor_ticks = 0;
+    ui8_wheel_speed_sensor_ticks_counter_started = 0;
+    enableInterrupts();
+}
+
+// Time since the last valid wheel speed sensor edge (WHEEL_SPEED_SENSOR_TICKS_SECOND units),
+// 0 if there is no reference edge, saturated to 0xffff
+uint16_t wheel_speed_sensor_elapsed_ticks(void) {
+    uint16_t ui16_now;
+    uint16_t ui16_old;
+    uint8_t ui8_wraps;
+    uint32_t ui32_ticks;
+
+    disableInterrupts();
+    if (!ui8_wheel_speed_sensor_ticks_counter_started) {
+        enableInterrupts();
+        return 0;
+    }
+    // TIM3 read by a single instruction (the PAS2 TLI reads TIM3 and can't be masked)
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        pushw x
+        ldw x, 0x5328                       // TIM3->CNTRH, TIM3->CNTRL
+        ldw _ui16_wheel_speed_sensor_now+0, x
+        popw x
+    __endasm;
+    #endif
+    ui16_now = ui16_wheel_speed_sensor_now;
+    ui16_old = ui16_wheel_speed_sensor_timestamp_old;
+    ui8_wraps = ui8_wheel_speed_sensor_wraps;
+    // TIM3 wrap not counted yet by the overflow interrupt
+    if ((TIM3->SR1 & TIM3_SR1_UIF) && !(ui16_now & 0x8000))
+        ui8_wraps++;
+    enableInterrupts();
+
+    ui32_ticks = (((uint32_t)ui8_wraps << 16) + ui16_now - ui16_old) >> WHEEL_SPEED_SENSOR_TICKS_SHIFT;
+    if (ui32_ticks > 0xffff)
+        return 0xffff;
+    return (uint16_t)ui32_ticks;
+}
+
+// Wheel speed sensor rising edge: pulse period from the TIM3 timestamps (4us) of two edges,
+// edges earlier than 1/8 of the last period are ignored (sensor bounce)
+void WHEEL_SPEED_SENSOR_PORT_IRQHandler(void) __interrupt(EXTI_WHEEL_SPEED_SENSOR_IRQ) {
+    uint32_t ui32_ticks;
+
+    #ifndef __CDT_PARSER__ // disable Eclipse syntax check
+    __asm
+        ldw x, 0x5328                       // TIM3->CNTRH, TIM3->CNTRL (not interruptible)
+        ldw _ui16_wheel_speed_sensor_timestamp+0, x
+    __endasm;
+    #endif
+
+    // TIM3 wrap not counted yet by the overflow interrupt (pending): count it here
+    if ((TIM3->SR1 & TIM3_SR1_UIF) && !(ui16_wheel_speed_sensor_timestamp & 0x8000)) {
+        TIM3->SR1 = (uint8_t)~TIM3_SR1_UIF;
+        ui8_wheel_speed_sensor_wraps++;
+    }
+
+    if (ui8_wheel_speed_sensor_ticks_counter_started) {
+        ui32_ticks = (((uint32_t)ui8_wheel_speed_sensor_wraps << 16) + ui16_wheel_speed_sensor_timestamp
+                - ui16_wheel_speed_sensor_timestamp_old) >> WHEEL_SPEED_SENSOR_TICKS_SHIFT;
+
+        if (ui16_wheel_speed_sensor_ticks) {
+            if (ui32_ticks <= (ui16_wheel_speed_sensor_ticks >> 3))
+                return;
+        } else if (ui32_ticks <= (ui16_wheel_speed_sensor_ticks_counter_min >> 3)) {
+            return;
+        }
+        if (ui32_ticks < ui16_wheel_speed_sensor_ticks_counter_max) {
+            // out of bounds (noise)
+            ui16_wheel_speed_sensor_ticks = 0;
+            ui8_wheel_speed_sensor_ticks_counter_started = 0;
+            return;
+        }
+        if (ui32_ticks > ui16_wheel_speed_sensor_ticks_counter_min) {
+            // wheel was stopped: this edge is the new reference
+            ui16_wheel_speed_sensor_ticks = 0;
+        } else {
+            // speed updated on every pulse, odometer on every wheel revolution
+            ui16_wheel_speed_sensor_ticks = (uint16_t)ui32_ticks;
+            if (++ui8_wheel_speed_sensor_pulses_counter >= ui8_wheel_speed_sensor_pulses) {
+                ui8_wheel_speed_sensor_pulses_counter = 0;
+                ++ui32_wheel_speed_sensor_ticks_total;
+            }
+        }
+    } else {
+        // first transition
+        ui8_wheel_speed_sensor_ticks_counter_started = 1;
+    }
+    ui16_wheel_speed_sensor_timestamp_old = ui16_wheel_speed_sensor_timestamp;
+    ui8_wheel_speed_sensor_wraps = 0;
+}
+
+// TIM3 overflow (every 262ms): wraps since the last wheel speed sensor edge, wheel stop detection
+void TIM3_OVF_IRQHandler(void) __interrupt(TIM3_OVF_IRQHANDLER) {
+    TIM3->SR1 = (uint8_t)~TIM3_SR1_UIF;
+    if (ui8_wheel_speed_sensor_ticks_counter_started) {
+        if (++ui8_wheel_speed_sensor_wraps > ui8_wheel_speed_sensor_wraps_max) {
+            // no edge for more than the pulse period limit: wheel stopped
+            ui16_wheel_speed_sensor_ticks = 0;
+            ui8_wheel_speed_sensor_ticks_counter_started = 0;
+        }
+    }
 }
@@ -9,6 +9,14 @@
 #ifndef _WHELL_SPEED_SENSOR_H_
 #define _WHELL_SPEED_SENSOR_H_
 
+#include <stdint.h>
+
+// wheel speed sensor
+extern volatile uint16_t ui16_wheel_speed_sensor_ticks;
+extern volatile uint32_t ui32_wheel_speed_sensor_ticks_total;
+
 void wheel_speed_sensor_init(void);
+void wheel_speed_sensor_set_pulses(uint8_t ui8_pulses);
+uint16_t wheel_speed_sensor_elapsed_ticks(void);
 
 #endif /* _WHELL_SPEED_SENSOR_H_ */